@@ -1,5 +1,6 @@
 #include "Triangle.hpp"
 #include "rasterizer.hpp"
+#include "ImageWriter.hpp"
 #include <Eigen/Eigen>
 #include <iostream>
 #include <opencv2/opencv.hpp>
@@ -86,12 +87,17 @@ int main(int argc, const char** argv)
     float angle = 0;
     bool command_line = false;
     std::string filename = "output.png";
+    int frames = 1;
 
+    // -r <angle> <filename> [frames]: with frames > 1 the triangle turns 360 / frames degrees per
+    // frame and the images go to filename_0000.png ...
     if (argc >= 3) {
         command_line = true;
         angle = std::stof(argv[2]); // -r by default
-        if (argc == 4) {
+        if (argc == 4 || argc == 5) {
             filename = std::string(argv[3]);
+            if (argc == 5)
+                frames = std::max(1, std::stoi(argv[4]));
         }
         else
             return 0;
@@ -112,19 +118,26 @@ int main(int argc, const char** argv)
     int frame_count = 0;
 
     if (command_line) {
-        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
-
-        r.set_model(get_model_matrix(angle));
-        r.set_view(get_view_matrix(eye_pos));
-        r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
-
-        r.draw(pos_id, ind_id, rst::Primitive::Triangle);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-
-        cv::imwrite(filename, image);
+        // Encodes frame i on a background thread while frame i + 1 renders
+        ImageWriter writer;
+        for (int i = 0; i < frames; i++) {
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+
+            r.set_model(get_model_matrix(angle + 360.0f * i / frames));
+            r.set_view(get_view_matrix(eye_pos));
+            r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
+
+            r.draw(pos_id, ind_id, rst::Primitive::Triangle);
+            // Resolved straight into the writer's buffer, no extra copy per frame
+            cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
+            cv::Mat buffer = writer.acquire(700, 700, CV_8UC3);
+            image.convertTo(buffer, CV_8UC3, 1.0f);
+
+            writer.submit(frames > 1 ? ImageWriter::sequenceName(filename, i) : filename, buffer);
+        }
+        writer.wait();
 
-        return 0;
+        return writer.failures() ? 1 : 0;
     }
 
     auto viewMat = get_view_matrix(eye_pos);
@@ -1,9 +1,11 @@
 // clang-format off
 #include <iostream>
+#include <chrono>
 #include <opencv2/opencv.hpp>
 #include "rasterizer.hpp"
 #include "global.hpp"
 #include "Triangle.hpp"
+#include "ImageWriter.hpp"
 
 constexpr double MY_PI = 3.1415926;
 
@@ -71,11 +73,22 @@ int main(int argc, const char** argv)
     float angle = 0;
     bool command_line = false;
     std::string filename = "output.png";
+    int frames = 1;
+    bool bench = false;
 
-    if (argc == 2)
+    // Rasterizer <filename> [frames]: with frames > 1 the scene turns 360 / frames degrees per frame
+    // and the images go to filename_0000.png ...
+    // Rasterizer --bench: MSAA against brute-force SSAA, nothing is written
+    if (argc == 2 && std::string(argv[1]) == "--bench")
+    {
+        bench = true;
+    }
+    else if (argc == 2 || argc == 3)
     {
         command_line = true;
         filename = std::string(argv[1]);
+        if (argc == 3)
+            frames = std::max(1, std::stoi(argv[2]));
     }
 
     rst::rasterizer r(700, 700);
@@ -116,24 +129,67 @@ int main(int argc, const char** argv)
     int key = 0;
     int frame_count = 0;
 
-    if (command_line)
+    // MSAA against brute-force SSAA at the same sample counts, same camera as the command line render
+    if (bench)
     {
-        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
-
+        const int frames = 100;
         r.set_model(get_model_matrix(angle));
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(90, 1, 1, 9));
 
-        r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
-
-        cv::imwrite(filename, image);
-
+        for (int samples : {1, 2, 4, 8})
+        {
+            for (bool ssaa : {false, true})
+            {
+                if (samples == 1 && ssaa)
+                    continue;
+                ssaa ? r.set_ssaa(samples) : r.set_msaa(samples);
+
+                uint64_t shaded = r.shaded();
+                auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < frames; i++)
+                {
+                    r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+                    r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
+                    r.frame_buffer();
+                }
+                auto stop = std::chrono::steady_clock::now();
+
+                double ms = std::chrono::duration<double, std::milli>(stop - start).count() / frames;
+                std::cout << (ssaa ? "SSAA " : "MSAA ") << samples << "x: " << ms << " ms/frame, "
+                          << (r.shaded() - shaded) / frames << " shader invocations/frame, "
+                          << 700 * 700 * samples * (sizeof(float) + sizeof(uint32_t)) / 1024 << " KiB sample storage\n";
+            }
+        }
         return 0;
     }
 
+    if (command_line)
+    {
+        // Encodes frame i on a background thread while frame i + 1 renders
+        ImageWriter writer;
+        for (int i = 0; i < frames; i++)
+        {
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+
+            r.set_model(get_model_matrix(angle + 360.0f * i / frames));
+            r.set_view(get_view_matrix(eye_pos));
+            r.set_projection(get_projection_matrix(90, 1, 1, 9));
+
+            r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
+            // Resolved straight into the writer's buffer, no extra copy per frame
+            cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
+            cv::Mat buffer = writer.acquire(700, 700, CV_8UC3);
+            image.convertTo(buffer, CV_8UC3, 1.0f);
+            cv::cvtColor(buffer, buffer, cv::COLOR_RGB2BGR);
+
+            writer.submit(frames > 1 ? ImageWriter::sequenceName(filename, i) : filename, buffer);
+        }
+        writer.wait();
+
+        return writer.failures() ? 1 : 0;
+    }
+
     while(key != 27)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
@@ -42,34 +42,71 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
 }
 
 
-static bool insideTriangle(float x, float y, const Vector3f* _v)
-{   
-    auto a = _v[0];
-    auto b = _v[1];
-    auto c = _v[2];
+// Triangle setup: E_i(x, y) = A[i] * x + B[i] * y + C[i] is the edge function of the edge opposite
+// vertex i, oriented so that points inside the triangle have all three E_i > 0.
+// E_i * inv_area is the barycentric coordinate of vertex i.
+struct triangle_setup
+{
+    float A[3], B[3], C[3];
+    float inv_area;
+};
 
-    Eigen::Vector3f ab = {_v[1].x() - _v[0].x(), _v[1].y() -_v[0].y(), 0};
-    Eigen::Vector3f ap = {x - _v[0].x(), y -_v[0].y(), 0};
+static bool setup_triangle(const std::array<Vector4f, 3>& v, triangle_setup& s)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        const auto& p = v[(i + 1) % 3];
+        const auto& q = v[(i + 2) % 3];
+        s.A[i] = p.y() - q.y();
+        s.B[i] = q.x() - p.x();
+        s.C[i] = p.x() * q.y() - q.x() * p.y();
+    }
 
-    Eigen::Vector3f bc = {_v[2].x() - _v[1].x(), _v[2].y() -_v[1].y(), 0};
-    Eigen::Vector3f bp = {x - _v[1].x(), y -_v[1].y(), 0};
+    float area = s.A[0] * v[0].x() + s.B[0] * v[0].y() + s.C[0];
+    if (area == 0 || !std::isfinite(area))
+        return false;
 
-    Eigen::Vector3f ca = {_v[0].x() - _v[2].x(), _v[0].y() -_v[2].y(), 0};
-    Eigen::Vector3f cp = {x - _v[2].x(), y -_v[2].y(), 0};
+    // Clockwise triangles: flip the edges so that "inside" is always E_i > 0
+    if (area < 0)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            s.A[i] = -s.A[i];
+            s.B[i] = -s.B[i];
+            s.C[i] = -s.C[i];
+        }
+        area = -area;
+    }
+    s.inv_area = 1.0f / area;
+    return true;
+}
 
-    Eigen::Vector3f v1 = ab.cross(ap);
-    Eigen::Vector3f v2 = bc.cross(bp);
-    Eigen::Vector3f v3 = ca.cross(cp);
-    return v1.dot(v2) > 0 && v2.dot(v3) > 0;
-    // TODO : Implement this function to check if the point (x, y) is inside the triangle represented by _v[0], _v[1], _v[2]
+// Sample positions relative to the pixel center: one centered sample, then the rotated grid
+// patterns of the common 2x/4x/8x MSAA modes (in 1/16 pixel units)
+const Eigen::Vector2f* rst::rasterizer::sample_pattern(int samples)
+{
+    static const Eigen::Vector2f pattern1[] = {{0, 0}};
+    static const Eigen::Vector2f pattern2[] = {{4 / 16.f, 4 / 16.f}, {-4 / 16.f, -4 / 16.f}};
+    static const Eigen::Vector2f pattern4[] = {{-2 / 16.f, -6 / 16.f}, {6 / 16.f, -2 / 16.f},
+                                               {-6 / 16.f, 2 / 16.f}, {2 / 16.f, 6 / 16.f}};
+    static const Eigen::Vector2f pattern8[] = {{1 / 16.f, -3 / 16.f}, {-1 / 16.f, 3 / 16.f},
+                                               {5 / 16.f, 1 / 16.f}, {-3 / 16.f, -5 / 16.f},
+                                               {-5 / 16.f, 5 / 16.f}, {-7 / 16.f, -1 / 16.f},
+                                               {3 / 16.f, 7 / 16.f}, {7 / 16.f, -7 / 16.f}};
+    switch (samples)
+    {
+        case 2: return pattern2;
+        case 4: return pattern4;
+        case 8: return pattern8;
+        default: return pattern1;
+    }
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector3f* v)
+// Sample colors are stored as packed 8 bit RGB, a quarter of an Eigen::Vector3f
+static uint32_t pack_color(const Eigen::Vector3f& color)
 {
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+    auto channel = [](float c) { return (uint32_t)std::clamp(std::lround(c), 0l, 255l); };
+    return channel(color.x()) | channel(color.y()) << 8 | channel(color.z()) << 16;
 }
 
 void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
@@ -125,7 +162,11 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
 //Screen space rasterization
 void rst::rasterizer::rasterize_triangle(const Triangle& t) {
     auto v = t.toVector4();
-    
+
+    triangle_setup s;
+    if (!setup_triangle(v, s))
+        return;
+
     float l = 99999999;
     float r = -9999999;
     float top = 99999999;
@@ -137,52 +178,88 @@ void rst::rasterizer::rasterize_triangle(const Triangle& t) {
         top = v[i].y() < top ? v[i].y() : top;
         d = v[i].y() > d ? v[i].y() : d;  
     }
-    
-    for (size_t y = top; y <= d; y++)
+
+    int x0 = (int)std::floor(std::clamp(l, 0.f, (float)width));
+    int x1 = (int)std::floor(std::clamp(r, -1.f, (float)width - 1));
+    int y0 = (int)std::floor(std::clamp(top, 0.f, (float)height));
+    int y1 = (int)std::floor(std::clamp(d, -1.f, (float)height - 1));
+
+    // Edge values of every sample are the pixel's edge values plus a constant per-triangle offset
+    const Eigen::Vector2f* pattern = sample_pattern(sample_count);
+    float sample_offset[MAX_SAMPLES][3];
+    for (int k = 0; k < sample_count; k++)
     {
-        for (size_t x = l; x <= r; x++)
+        for (int i = 0; i < 3; i++)
         {
-            float left = x - 0.25f;
-            float right = x + 0.25f;
-            float bottom = y - 0.25f;
-            float top = y + 0.25f;
-            
-            int count = 0;
-            if(insideTriangle(left, bottom, t.v))
-            {
-                count += 1;
-            }
-            
-            if(insideTriangle(left, top, t.v))
-            {
-                count += 1;
-            }
+            sample_offset[k][i] = s.A[i] * pattern[k].x() + s.B[i] * pattern[k].y();
+        }
+    }
 
-            if(insideTriangle(right, top, t.v))
-            {
-                count += 1;
-            }
+    // Edge values are evaluated once at (x0, y0) and then stepped by B per row and A per pixel
+    float e_row[3];
+    for (int i = 0; i < 3; i++)
+    {
+        e_row[i] = s.A[i] * x0 + s.B[i] * y0 + s.C[i];
+    }
 
-            if(insideTriangle(right, bottom, t.v))
+    for (int y = y0; y <= y1; y++)
+    {
+        float e[3] = {e_row[0], e_row[1], e_row[2]};
+        for (int x = x0; x <= x1; x++)
+        {
+            unsigned coverage = 0;
+            for (int k = 0; k < sample_count; k++)
             {
-                count += 1;
+                if (e[0] + sample_offset[k][0] > 0 && e[1] + sample_offset[k][1] > 0 && e[2] + sample_offset[k][2] > 0)
+                {
+                    coverage |= 1u << k;
+                }
             }
 
-            if (count > 0)
-            // if(insideTriangle(x, y, t.v))
+            if (coverage)
             {
-                auto[alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-                float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                z_interpolated *= w_reciprocal;
+                // MSAA shades at most once per pixel and triangle, SSAA once per visible sample
+                uint32_t color = 0;
+                bool shaded = false;
 
-                if (depth_buf[y*width+x] == std::numeric_limits<float>::infinity() || z_interpolated > depth_buf[y*width+x])
+                int first = (y * width + x) * sample_count;
+                for (int k = 0; k < sample_count; k++)
                 {
-                    depth_buf[y*width+x] = z_interpolated;
-                    set_pixel(Eigen::Vector3f(x, y, z_interpolated), t.getColor() * count/4);
-                    // set_pixel(Eigen::Vector3f(x, y, z_interpolated), t.getColor());
+                    if (!(coverage & (1u << k)))
+                        continue;
+
+                    float alpha = (e[0] + sample_offset[k][0]) * s.inv_area;
+                    float beta = (e[1] + sample_offset[k][1]) * s.inv_area;
+                    float gamma = (e[2] + sample_offset[k][2]) * s.inv_area;
+                    float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
+                    float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
+                    z_interpolated *= w_reciprocal;
+
+                    float& depth = sample_depth[first + k];
+                    if (depth == std::numeric_limits<float>::infinity() || z_interpolated > depth)
+                    {
+                        if (!shaded || supersample)
+                        {
+                            color = pack_color(t.getColor());
+                            shaded = true;
+                            shade_count++;
+                        }
+                        depth = z_interpolated;
+                        sample_color[first + k] = color;
+                    }
                 }
-            }            
+                resolved = resolved && !shaded;
+            }
+
+            for (int i = 0; i < 3; i++)
+            {
+                e[i] += s.A[i];
+            }
+        }
+
+        for (int i = 0; i < 3; i++)
+        {
+            e_row[i] += s.B[i];
         }
     }
     
@@ -219,17 +296,66 @@ void rst::rasterizer::clear(rst::Buffers buff)
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
         std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        std::fill(sample_color.begin(), sample_color.end(), 0);
+        resolved = true;
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
-        std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        std::fill(sample_depth.begin(), sample_depth.end(), std::numeric_limits<float>::infinity());
     }
 }
 
 rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
     frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
+    set_msaa(4);
+}
+
+void rst::rasterizer::set_msaa(int samples)
+{
+    set_samples(samples, false);
+}
+
+void rst::rasterizer::set_ssaa(int samples)
+{
+    set_samples(samples, true);
+}
+
+void rst::rasterizer::set_samples(int samples, bool ssaa)
+{
+    sample_count = samples == 2 || samples == 4 || samples == 8 ? samples : 1;
+    supersample = ssaa;
+    sample_depth.assign(width * height * sample_count, std::numeric_limits<float>::infinity());
+    sample_color.assign(width * height * sample_count, 0);
+    resolved = false;
+}
+
+// Averages the samples of every pixel into frame_buf
+void rst::rasterizer::resolve()
+{
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const uint32_t* samples = &sample_color[(y * width + x) * sample_count];
+            Eigen::Vector3f sum{0, 0, 0};
+            for (int k = 0; k < sample_count; k++)
+            {
+                sum += Eigen::Vector3f(samples[k] & 0xff, (samples[k] >> 8) & 0xff, (samples[k] >> 16) & 0xff);
+            }
+            frame_buf[get_index(x, y)] = sum / sample_count;
+        }
+    }
+    resolved = true;
+}
+
+std::vector<Eigen::Vector3f>& rst::rasterizer::frame_buffer()
+{
+    if (!resolved)
+    {
+        resolve();
+    }
+    return frame_buf;
 }
 
 int rst::rasterizer::get_index(int x, int y)
@@ -66,19 +66,31 @@ namespace rst
         void set_view(const Eigen::Matrix4f& v);
         void set_projection(const Eigen::Matrix4f& p);
 
+        // Multisampling with per-sample depth and color; 1, 2, 4 or 8 samples per pixel (default 4).
+        // MSAA shades once per pixel and triangle, SSAA shades every sample (for comparison).
+        void set_msaa(int samples);
+        void set_ssaa(int samples);
+        int samples() const { return sample_count; }
+        uint64_t shaded() const { return shade_count; }
+
         void set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color);
 
         void clear(Buffers buff);
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // Resolves the samples first if anything was drawn since the last call
+        std::vector<Eigen::Vector3f>& frame_buffer();
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
         void rasterize_triangle(const Triangle& t);
 
+        void set_samples(int samples, bool ssaa);
+        void resolve();
+        static const Eigen::Vector2f* sample_pattern(int samples);
+
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
     private:
@@ -92,7 +104,15 @@ namespace rst
 
         std::vector<Eigen::Vector3f> frame_buf;
 
-        std::vector<float> depth_buf;
+        // sample_count consecutive entries per pixel, pixels in row-major order
+        static constexpr int MAX_SAMPLES = 8;
+        int sample_count = 1;
+        bool supersample = false;
+        std::vector<float> sample_depth;
+        std::vector<uint32_t> sample_color;
+        bool resolved = true;
+        uint64_t shade_count = 0;
+
         int get_index(int x, int y);
 
         int width, height;
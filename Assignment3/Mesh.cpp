@@ -0,0 +1,44 @@
+//
+// Indexed triangle mesh with its vertex attributes in one arena allocation
+//
+
+#include "Mesh.hpp"
+
+Arena::Arena(size_t capacity) : storage(new unsigned char[capacity]), size(capacity)
+{
+}
+
+Mesh::Mesh(int vertexCount, int triangleCount)
+    : arena(Arena::footprint<Eigen::Vector3f>(vertexCount) * 2 + Arena::footprint<Eigen::Vector2f>(vertexCount) +
+            Arena::footprint<Eigen::Vector4f>(vertexCount) + Arena::footprint<Eigen::Vector3i>(triangleCount)),
+      vertex_count(vertexCount), triangle_count(triangleCount)
+{
+    position_data = arena.allocate<Eigen::Vector3f>(vertexCount);
+    normal_data = arena.allocate<Eigen::Vector3f>(vertexCount);
+    tex_coord_data = arena.allocate<Eigen::Vector2f>(vertexCount);
+    tangent_data = arena.allocate<Eigen::Vector4f>(vertexCount);
+    index_data = arena.allocate<Eigen::Vector3i>(triangleCount);
+    for (int i = 0; i < vertexCount; i++)
+    {
+        tangent_data[i] = Eigen::Vector4f(0, 0, 0, 1);
+    }
+}
+
+Mesh Mesh::unindexed() const
+{
+    Mesh list(triangle_count * 3, triangle_count);
+    for (int i = 0; i < triangle_count; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            int from = index_data[i][j];
+            int to = i * 3 + j;
+            list.position_data[to] = position_data[from];
+            list.normal_data[to] = normal_data[from];
+            list.tex_coord_data[to] = tex_coord_data[from];
+            list.tangent_data[to] = tangent_data[from];
+        }
+        list.index_data[i] = Eigen::Vector3i(i * 3, i * 3 + 1, i * 3 + 2);
+    }
+    return list;
+}
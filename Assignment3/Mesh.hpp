@@ -0,0 +1,91 @@
+//
+// Indexed triangle mesh with its vertex attributes in one arena allocation
+//
+
+#ifndef RASTERIZER_MESH_H
+#define RASTERIZER_MESH_H
+
+#include <Eigen/Eigen>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+// Bump allocator over a single block: allocate hands out consecutive aligned ranges, all of them
+// are released together with the arena
+class Arena{
+public:
+    Arena() = default;
+    explicit Arena(size_t capacity);
+
+    // Bytes needed for count objects of T in the worst case of alignment padding
+    template <typename T>
+    static size_t footprint(size_t count) { return count * sizeof(T) + alignof(T) - 1; }
+
+    // count default constructed objects of T; they are never destroyed, so T must not need it
+    template <typename T>
+    T* allocate(size_t count)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are not destroyed");
+        size_t start = (offset + alignof(T) - 1) / alignof(T) * alignof(T);
+        if (start + count * sizeof(T) > size)
+            throw std::bad_alloc();
+        offset = start + count * sizeof(T);
+        T* objects = reinterpret_cast<T*>(storage.get() + start);
+        for (size_t i = 0; i < count; i++)
+            new (&objects[i]) T;
+        return objects;
+    }
+
+    size_t capacity() const { return size; }
+    size_t used() const { return offset; }
+
+private:
+    std::unique_ptr<unsigned char[]> storage;
+    size_t size = 0;
+    size_t offset = 0;
+};
+
+// Structure of arrays: one contiguous array per vertex attribute plus the index triples, all
+// carved out of one arena sized up front. Triangles refer to vertices by index, the rasterizer
+// draws straight from these arrays (see rasterizer::draw(const Mesh&)).
+class Mesh{
+public:
+    Mesh() = default;
+    Mesh(int vertexCount, int triangleCount);
+    Mesh(Mesh&&) = default;
+    Mesh& operator=(Mesh&&) = default;
+
+    int vertexCount() const { return vertex_count; }
+    int triangleCount() const { return triangle_count; }
+
+    Eigen::Vector3f* positions() { return position_data; }
+    Eigen::Vector3f* normals() { return normal_data; }
+    Eigen::Vector2f* texCoords() { return tex_coord_data; }
+    Eigen::Vector4f* tangents() { return tangent_data; } // w is the sign of the bitangent n x t
+    Eigen::Vector3i* indices() { return index_data; }
+
+    const Eigen::Vector3f* positions() const { return position_data; }
+    const Eigen::Vector3f* normals() const { return normal_data; }
+    const Eigen::Vector2f* texCoords() const { return tex_coord_data; }
+    const Eigen::Vector4f* tangents() const { return tangent_data; }
+    const Eigen::Vector3i* indices() const { return index_data; }
+
+    // Bytes held by the mesh, all in one allocation
+    size_t memoryBytes() const { return arena.capacity(); }
+
+    // Copy where every triangle has its own three vertices (no vertex shared between triangles)
+    Mesh unindexed() const;
+
+private:
+    Arena arena;
+    int vertex_count = 0;
+    int triangle_count = 0;
+    Eigen::Vector3f* position_data = nullptr;
+    Eigen::Vector3f* normal_data = nullptr;
+    Eigen::Vector2f* tex_coord_data = nullptr;
+    Eigen::Vector4f* tangent_data = nullptr;
+    Eigen::Vector3i* index_data = nullptr;
+};
+
+#endif //RASTERIZER_MESH_H
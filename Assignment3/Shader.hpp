@@ -5,8 +5,103 @@
 #ifndef RASTERIZER_SHADER_H
 #define RASTERIZER_SHADER_H
 #include <Eigen/Eigen>
+#include <algorithm>
+#include <vector>
 #include "Texture.hpp"
 
+// Payload fields a fragment shader reads. The rasterizer sets up and interpolates only these, the
+// other fields keep their defaults.
+enum class Varyings : unsigned
+{
+    None = 0,
+    Color = 1,
+    Normal = 2,
+    TexCoords = 4,
+    ViewPos = 8,
+    Tangent = 16,
+    TexDerivatives = 32, // tex_coords_dx and tex_coords_dy
+    All = 63
+};
+
+inline Varyings operator|(Varyings a, Varyings b)
+{
+    return Varyings((unsigned)a | (unsigned)b);
+}
+
+inline Varyings operator&(Varyings a, Varyings b)
+{
+    return Varyings((unsigned)a & (unsigned)b);
+}
+
+inline bool uses(Varyings set, Varyings v)
+{
+    return (set & v) != Varyings::None;
+}
+
+struct light
+{
+    Eigen::Vector3f position;
+    Eigen::Vector3f intensity;
+    // Distance at which the light fades out completely, 0 for a light that reaches everything.
+    // Only lights with a radius can be culled per tile, see rasterizer::set_light_culling.
+    float radius = 0;
+};
+
+// Smooth window (1 - (d / radius)^4)^2 that takes the light to exactly zero at its radius, given the
+// squared distance r2; 1 for lights without a radius
+inline float light_falloff(const light& l, float r2)
+{
+    if (l.radius <= 0)
+        return 1;
+    float x = r2 / (l.radius * l.radius);
+    float w = std::clamp(1 - x * x, 0.f, 1.f);
+    return w * w;
+}
+
+// Indices into light_block::lights of the lights a fragment has to evaluate
+struct light_list
+{
+    const int* first = nullptr;
+    const int* last = nullptr;
+
+    const int* begin() const { return first; }
+    const int* end() const { return last; }
+    size_t size() const { return last - first; }
+};
+
+// Uniform blocks: values that stay the same over a draw. They are bound on the rasterizer
+// (set_lights, set_camera, set_material) and reach the fragment shaders by pointer, so shading a
+// fragment neither copies nor allocates them.
+struct light_block
+{
+    std::vector<light> lights;
+    // Added once per fragment, whatever lights reach it
+    Eigen::Vector3f ambient = Eigen::Vector3f::Zero();
+};
+
+struct camera_block
+{
+    // In the space of fragment_shader_payload::view_pos
+    Eigen::Vector3f eye_pos = Eigen::Vector3f::Zero();
+};
+
+struct material_block
+{
+    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
+    float p = 150;           // specular exponent
+    float kh = 0.2, kn = 0.1; // bump and displacement scales
+    // Height field of the bump and displacement shaders (Texture::bakeHeightGradients), owned by
+    // the caller; only those shaders read it
+    const Texture::Derived* height_field = nullptr;
+};
+
+struct shader_uniforms
+{
+    light_block lighting;
+    camera_block camera;
+    material_block material;
+};
 
 struct fragment_shader_payload
 {
@@ -19,11 +114,18 @@ struct fragment_shader_payload
          color(col), normal(nor), tex_coords(tc), texture(tex) {}
 
 
-    Eigen::Vector3f view_pos;
-    Eigen::Vector3f color;
-    Eigen::Vector3f normal;
-    Eigen::Vector2f tex_coords;
+    Eigen::Vector3f view_pos = Eigen::Vector3f::Zero();
+    Eigen::Vector3f color = Eigen::Vector3f::Zero();
+    Eigen::Vector3f normal = Eigen::Vector3f::Zero();
+    Eigen::Vector2f tex_coords = Eigen::Vector2f::Zero();
+    // Change of tex_coords to the next pixel in x and in y, for mip level selection
+    Eigen::Vector2f tex_coords_dx = Eigen::Vector2f::Zero();
+    Eigen::Vector2f tex_coords_dy = Eigen::Vector2f::Zero();
+    // Interpolated tangent, w is the sign of the bitangent n x t
+    Eigen::Vector4f tangent = Eigen::Vector4f(0, 0, 0, 1);
     Texture* texture;
+    const shader_uniforms* uniforms = nullptr;
+    light_list lights;
 };
 
 struct vertex_shader_payload
@@ -31,4 +133,40 @@ struct vertex_shader_payload
     Eigen::Vector3f position;
 };
 
+// Fragments in structure of arrays form, lane i holds a fragment when bit i of active is set
+constexpr int FRAGMENT_BATCH_SIZE = 8;
+static_assert(FRAGMENT_BATCH_SIZE == Texture::SAMPLE_BATCH, "batch shaders sample a whole batch at once");
+
+struct fragment_batch
+{
+    float view_pos[3][FRAGMENT_BATCH_SIZE];
+    float color[3][FRAGMENT_BATCH_SIZE];
+    float normal[3][FRAGMENT_BATCH_SIZE];
+    float tex_coords[2][FRAGMENT_BATCH_SIZE];
+    float tex_coords_dx[2][FRAGMENT_BATCH_SIZE];
+    float tex_coords_dy[2][FRAGMENT_BATCH_SIZE];
+    float tangent[4][FRAGMENT_BATCH_SIZE];
+    Texture* texture = nullptr;
+    const shader_uniforms* uniforms = nullptr;
+    light_list lights; // the same for every lane
+    unsigned active = 0;
+};
+
+// Writes the rgb color of every active lane of batch to colors[channel][lane]
+using fragment_batch_shader = void (*)(const fragment_batch& batch, float colors[3][FRAGMENT_BATCH_SIZE]);
+
+// Shades count fragments at once: colors[i] = shader(payloads[i])
+using fragment_span_shader = void (*)(const fragment_shader_payload* payloads, unsigned count, Eigen::Vector3f* colors);
+
+// Span shader specialized for one fragment shader at compile time; the call is direct, so the
+// shader is inlined into the loop instead of going through a std::function per fragment
+template <Eigen::Vector3f (*Shader)(const fragment_shader_payload&)>
+void shade_span(const fragment_shader_payload* payloads, unsigned count, Eigen::Vector3f* colors)
+{
+    for (unsigned i = 0; i < count; ++i)
+    {
+        colors[i] = Shader(payloads[i]);
+    }
+}
+
 #endif //RASTERIZER_SHADER_H
@@ -2,3 +2,263 @@
 // Created by LEI XU on 4/27/19.
 //
 
+#include "Texture.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define TEXTURE_AVX2_SAMPLER 1
+#endif
+
+void Texture::build_mips()
+{
+    texels.clear();
+    level_width.clear();
+    level_height.clear();
+    level_tiles_x.clear();
+    level_offset.clear();
+
+    cv::Mat level = image_data;
+    store_level(level);
+    while (level.cols > 1 || level.rows > 1)
+    {
+        cv::Mat next(std::max(1, level.rows / 2), std::max(1, level.cols / 2), CV_8UC3);
+        for (int y = 0; y < next.rows; y++)
+        {
+            int y0 = std::min(2 * y, level.rows - 1), y1 = std::min(2 * y + 1, level.rows - 1);
+            for (int x = 0; x < next.cols; x++)
+            {
+                int x0 = std::min(2 * x, level.cols - 1), x1 = std::min(2 * x + 1, level.cols - 1);
+                const auto& c00 = level.at<cv::Vec3b>(y0, x0);
+                const auto& c01 = level.at<cv::Vec3b>(y0, x1);
+                const auto& c10 = level.at<cv::Vec3b>(y1, x0);
+                const auto& c11 = level.at<cv::Vec3b>(y1, x1);
+                auto& out = next.at<cv::Vec3b>(y, x);
+                for (int c = 0; c < 3; c++)
+                {
+                    out[c] = (c00[c] + c01[c] + c10[c] + c11[c] + 2) / 4;
+                }
+            }
+        }
+        level = next;
+        store_level(level);
+    }
+}
+
+void Texture::store_level(const cv::Mat& img)
+{
+    int tiles_x = (img.cols + TEXEL_TILE - 1) / TEXEL_TILE;
+    int tiles_y = (img.rows + TEXEL_TILE - 1) / TEXEL_TILE;
+    int offset = (int)texels.size();
+
+    level_width.push_back(img.cols);
+    level_height.push_back(img.rows);
+    level_tiles_x.push_back(tiles_x);
+    level_offset.push_back(offset);
+
+    // The padding repeats the last row/column
+    texels.resize(offset + tiles_x * tiles_y * TEXEL_TILE * TEXEL_TILE);
+    for (int y = 0; y < tiles_y * TEXEL_TILE; y++)
+    {
+        for (int x = 0; x < tiles_x * TEXEL_TILE; x++)
+        {
+            const auto& c = img.at<cv::Vec3b>(std::min(y, img.rows - 1), std::min(x, img.cols - 1));
+            int tile = (y / TEXEL_TILE) * tiles_x + x / TEXEL_TILE;
+            texels[offset + tile * TEXEL_TILE * TEXEL_TILE + (y % TEXEL_TILE) * TEXEL_TILE + x % TEXEL_TILE] =
+                    c[0] | (c[1] << 8) | (c[2] << 16) | (0xffu << 24);
+        }
+    }
+}
+
+Texture::Derived Texture::derive(int channels, const std::function<void(int, int, float*)>& bake) const
+{
+    Derived d;
+    d.width = width;
+    d.height = height;
+    d.channels = channels;
+    d.wrap = wrap;
+    d.texels.resize((size_t)width * height * channels);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            bake(x, y, &d.texels[((size_t)y * width + x) * channels]);
+        }
+    }
+    return d;
+}
+
+Texture::Derived Texture::bakeHeightGradients() const
+{
+    std::vector<float> heights((size_t)width * height);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            uint32_t c = fetch(0, x, y);
+            heights[(size_t)y * width + x] = Eigen::Vector3f(channel(c, 0), channel(c, 1), channel(c, 2)).norm();
+        }
+    }
+
+    // +v goes up the image, so the next texel in v is the row above
+    return derive(3, [&](int x, int y, float* out) {
+        float h = heights[(size_t)y * width + x];
+        out[0] = h;
+        out[1] = heights[(size_t)y * width + wrap_coord(x + 1, width, wrap)] - h;
+        out[2] = heights[(size_t)wrap_coord(y - 1, height, wrap) * width + x] - h;
+    });
+}
+
+Texture::Derived Texture::bakeNormalMap(float scale) const
+{
+    Derived gradients = bakeHeightGradients();
+    return derive(3, [&](int x, int y, float* out) {
+        const float* g = &gradients.texels[((size_t)y * width + x) * 3];
+        Eigen::Vector3f n = Eigen::Vector3f(-scale * g[1], -scale * g[2], 1.0f).normalized();
+        out[0] = n.x();
+        out[1] = n.y();
+        out[2] = n.z();
+    });
+}
+
+#ifdef TEXTURE_AVX2_SAMPLER
+static_assert(Texture::SAMPLE_BATCH == 8, "the AVX2 sampler handles 8 lanes at once");
+
+// Per level tables of the texture being sampled
+struct sampler_tables
+{
+    const uint32_t* texels;
+    const int* width;
+    const int* height;
+    const int* tiles_x;
+    const int* offset;
+    int levels;
+    bool repeat;
+};
+
+__attribute__((target("avx2")))
+static __m256i wrap_coord_avx2(__m256i x, __m256i size, bool repeat)
+{
+    if (!repeat)
+    {
+        return _mm256_min_epi32(_mm256_max_epi32(x, _mm256_setzero_si256()), _mm256_sub_epi32(size, _mm256_set1_epi32(1)));
+    }
+
+    // x - size * floor(x / size), then one fix up step for the rounding of the division
+    __m256 q = _mm256_floor_ps(_mm256_div_ps(_mm256_cvtepi32_ps(x), _mm256_cvtepi32_ps(size)));
+    __m256i r = _mm256_sub_epi32(x, _mm256_mullo_epi32(_mm256_cvttps_epi32(q), size));
+    r = _mm256_add_epi32(r, _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), r), size));
+    r = _mm256_sub_epi32(r, _mm256_andnot_si256(_mm256_cmpgt_epi32(size, r), size));
+    return r;
+}
+
+// offset + ((y / 4) * tiles_x + x / 4) * 16 + (y % 4) * 4 + x % 4, see Texture::fetch
+__attribute__((target("avx2")))
+static __m256i texel_index_avx2(__m256i x, __m256i y, __m256i tiles_x, __m256i offset)
+{
+    __m256i tile = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(y, 2), tiles_x), _mm256_srli_epi32(x, 2));
+    __m256i in_tile = _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(y, _mm256_set1_epi32(3)), 2),
+                                       _mm256_and_si256(x, _mm256_set1_epi32(3)));
+    return _mm256_add_epi32(offset, _mm256_add_epi32(_mm256_slli_epi32(tile, 4), in_tile));
+}
+
+// Bilinear lookups of 8 lanes, each in its own level; same arithmetic as Texture::getColorLevel
+__attribute__((target("avx2")))
+static void bilinear_avx2(const sampler_tables& t, __m256i level, __m256 u, __m256 v, __m256 out[3])
+{
+    __m256i w = _mm256_i32gather_epi32(t.width, level, 4);
+    __m256i h = _mm256_i32gather_epi32(t.height, level, 4);
+    __m256i tiles_x = _mm256_i32gather_epi32(t.tiles_x, level, 4);
+    __m256i offset = _mm256_i32gather_epi32(t.offset, level, 4);
+
+    const __m256 half = _mm256_set1_ps(0.5f);
+    __m256 x = _mm256_sub_ps(_mm256_mul_ps(u, _mm256_cvtepi32_ps(w)), half);
+    __m256 y = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), v), _mm256_cvtepi32_ps(h)), half);
+    __m256 x0f = _mm256_floor_ps(x), y0f = _mm256_floor_ps(y);
+    __m256 fx = _mm256_sub_ps(x, x0f), fy = _mm256_sub_ps(y, y0f);
+
+    const __m256i one = _mm256_set1_epi32(1);
+    __m256i x0 = _mm256_cvttps_epi32(x0f), y0 = _mm256_cvttps_epi32(y0f);
+    __m256i xa = wrap_coord_avx2(x0, w, t.repeat), xb = wrap_coord_avx2(_mm256_add_epi32(x0, one), w, t.repeat);
+    __m256i ya = wrap_coord_avx2(y0, h, t.repeat), yb = wrap_coord_avx2(_mm256_add_epi32(y0, one), h, t.repeat);
+
+    const int* base = (const int*)t.texels;
+    __m256i c00 = _mm256_i32gather_epi32(base, texel_index_avx2(xa, ya, tiles_x, offset), 4);
+    __m256i c10 = _mm256_i32gather_epi32(base, texel_index_avx2(xb, ya, tiles_x, offset), 4);
+    __m256i c01 = _mm256_i32gather_epi32(base, texel_index_avx2(xa, yb, tiles_x, offset), 4);
+    __m256i c11 = _mm256_i32gather_epi32(base, texel_index_avx2(xb, yb, tiles_x, offset), 4);
+
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    for (int c = 0; c < 3; c++)
+    {
+        __m256 f00 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(c00, 8 * c), mask));
+        __m256 f10 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(c10, 8 * c), mask));
+        __m256 f01 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(c01, 8 * c), mask));
+        __m256 f11 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(c11, 8 * c), mask));
+        __m256 top = _mm256_add_ps(f00, _mm256_mul_ps(_mm256_sub_ps(f10, f00), fx));
+        __m256 bottom = _mm256_add_ps(f01, _mm256_mul_ps(_mm256_sub_ps(f11, f01), fx));
+        out[c] = _mm256_add_ps(top, _mm256_mul_ps(_mm256_sub_ps(bottom, top), fy));
+    }
+}
+
+__attribute__((target("avx2")))
+static void trilinear_avx2(const sampler_tables& t, const float u[8], const float v[8], const float lod[8], unsigned active, float colors[3][8])
+{
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256 on = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32((int)active), lane_bits), _mm256_setzero_si256()));
+
+    // Inactive lanes sample texel (0, 0) of level 0 so the gathers stay in bounds
+    __m256 uu = _mm256_and_ps(_mm256_loadu_ps(u), on);
+    __m256 vv = _mm256_and_ps(_mm256_loadu_ps(v), on);
+    __m256 ll = _mm256_and_ps(_mm256_loadu_ps(lod), on);
+
+    __m256i level = _mm256_cvttps_epi32(ll);
+    __m256 frac = _mm256_sub_ps(ll, _mm256_cvtepi32_ps(level));
+    __m256i next = _mm256_min_epi32(_mm256_add_epi32(level, _mm256_set1_epi32(1)), _mm256_set1_epi32(t.levels - 1));
+
+    __m256 c0[3], c1[3];
+    bilinear_avx2(t, level, uu, vv, c0);
+    bilinear_avx2(t, next, uu, vv, c1);
+
+    __m256 blend = _mm256_cmp_ps(frac, _mm256_setzero_ps(), _CMP_GT_OQ);
+    for (int c = 0; c < 3; c++)
+    {
+        __m256 mixed = _mm256_add_ps(c0[c], _mm256_mul_ps(_mm256_sub_ps(c1[c], c0[c]), frac));
+        __m256 color = _mm256_blendv_ps(c0[c], mixed, blend);
+        _mm256_storeu_ps(colors[c], _mm256_and_ps(color, on));
+    }
+}
+#endif
+
+void Texture::sampleTrilinear(const float u[SAMPLE_BATCH], const float v[SAMPLE_BATCH], const float lod[SAMPLE_BATCH],
+                              unsigned active, float colors[3][SAMPLE_BATCH]) const
+{
+#ifdef TEXTURE_AVX2_SAMPLER
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2)
+    {
+        sampler_tables t{texels.data(), level_width.data(), level_height.data(), level_tiles_x.data(), level_offset.data(),
+                         mipLevels(), wrap == Wrap::Repeat};
+        trilinear_avx2(t, u, v, lod, active, colors);
+        return;
+    }
+#endif
+
+    for (int i = 0; i < SAMPLE_BATCH; i++)
+    {
+        Eigen::Vector3f c = Eigen::Vector3f::Zero();
+        if (active & (1u << i))
+        {
+            int level = (int)lod[i];
+            float frac = lod[i] - level;
+            c = getColorLevel(u[i], v[i], level);
+            if (frac > 0)
+            {
+                c += (getColorLevel(u[i], v[i], level + 1) - c) * frac;
+            }
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            colors[k][i] = c[k];
+        }
+    }
+}
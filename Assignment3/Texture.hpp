@@ -8,11 +8,74 @@
 #include <Eigen/Eigen>
 #include <opencv2/opencv.hpp>
 #include <math.h>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <vector>
 
 class Texture{
+public:
+    enum class Wrap { Clamp, Repeat };
+
+    // Lanes of one sampleTrilinear call
+    static constexpr int SAMPLE_BATCH = 8;
+
+    // Float texture baked once from the base level, see derive. Sampled from the nearest texel,
+    // coordinates are floored before wrapping so Repeat stays continuous across 0.
+    struct Derived
+    {
+        int width = 0, height = 0, channels = 0;
+        Wrap wrap = Wrap::Clamp;
+        std::vector<float> texels;
+
+        bool empty() const { return texels.empty(); }
+
+        const float* getTexel(float u, float v) const
+        {
+            assert(!empty() && "sampling a derived texture that was never baked");
+            int x = wrap_coord((int)floorf(u * width), width, wrap);
+            int y = wrap_coord((int)floorf((1 - v) * height), height, wrap);
+            return &texels[(y * width + x) * channels];
+        }
+    };
+
 private:
     cv::Mat image_data;
 
+    // Texels of every mip level, converted once at load: RGBA8 (alpha unused) stored in 4x4 tiles of
+    // 64 bytes, so the four texels of a bilinear lookup share a cache line most of the time. Levels
+    // are padded to whole tiles. Level 0 is image_data and every next level halves the previous one
+    // with a 2x2 box filter.
+    static constexpr int TEXEL_TILE = 4;
+    std::vector<uint32_t> texels;
+    std::vector<int> level_width, level_height, level_tiles_x, level_offset;
+
+    void build_mips();
+    void store_level(const cv::Mat& img);
+
+    static int wrap_coord(int x, int size, Wrap wrap)
+    {
+        if (wrap == Wrap::Repeat)
+            return ((x % size) + size) % size;
+        return std::clamp(x, 0, size - 1);
+    }
+
+    uint32_t fetch(int level, int x, int y) const
+    {
+        x = wrap_coord(x, level_width[level], wrap);
+        y = wrap_coord(y, level_height[level], wrap);
+        int tile = (y / TEXEL_TILE) * level_tiles_x[level] + x / TEXEL_TILE;
+        return texels[level_offset[level] + tile * TEXEL_TILE * TEXEL_TILE + (y % TEXEL_TILE) * TEXEL_TILE + x % TEXEL_TILE];
+    }
+
+    static int channel(uint32_t texel, int c) { return (texel >> (8 * c)) & 0xff; }
+
+    float footprint(const Eigen::Vector2f& duv) const
+    {
+        return duv.cwiseProduct(Eigen::Vector2f(width, height)).norm();
+    }
+
 public:
     Texture(const std::string& name)
     {
@@ -20,54 +83,114 @@ public:
         cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
         width = image_data.cols;
         height = image_data.rows;
+        build_mips();
     }
 
     int width, height;
+    // Addressing outside [0, 1]
+    Wrap wrap = Wrap::Clamp;
+    // Taps along the major axis of the pixel footprint in getColorTrilinear, 1 is plain trilinear
+    int max_anisotropy = 1;
+
+    int mipLevels() const { return (int)level_width.size(); }
 
-    Eigen::Vector3f getColor(float u, float v)
+    // Bakes a derived texture the size of the base level; bake(x, y, out) writes the channels
+    // values of texel (x, y), y counted from the top row like getColor
+    Derived derive(int channels, const std::function<void(int, int, float*)>& bake) const;
+    // Height field of the bump and displacement shaders: channel 0 is the height (norm of the
+    // color), 1 and 2 its forward differences to the next texel in +u and +v
+    Derived bakeHeightGradients() const;
+    // Tangent space normals (-scale * dh/du, -scale * dh/dv, 1), normalized, of the height field
+    Derived bakeNormalMap(float scale) const;
+
+    Eigen::Vector3f getColor(float u, float v) const
     {
         auto u_img = u * width;
         auto v_img = (1 - v) * height;
-        auto color = image_data.at<cv::Vec3b>(v_img, u_img);
-        return Eigen::Vector3f(color[0], color[1], color[2]);
+        uint32_t color = fetch(0, (int)u_img, (int)v_img);
+        return Eigen::Vector3f(channel(color, 0), channel(color, 1), channel(color, 2));
     }
-    
-    cv::Vec3b lerp(float x, cv::Vec3b v0, cv::Vec3b v1)
+
+    Eigen::Vector3f getColorBiLinear(float u, float v) const
     {
-        return v0 + (v1-v0) * x;
+        return getColorLevel(u, v, 0);
     }
 
-    Eigen::Vector3f getColorBiLinear(float u, float v)
+    // Bilinear lookup in one mip level, texel centers at half integers
+    Eigen::Vector3f getColorLevel(float u, float v, int level) const
     {
-        auto u_img = u * width;
-        auto v_img = (1 - v) * height;
-        
-        int v0 = floorf(v_img);
-        int v1 = ceilf(v_img);
+        float x = u * level_width[level] - 0.5f;
+        float y = (1 - v) * level_height[level] - 0.5f;
 
-        int u0 = floorf(u_img);
-        int u1 = ceilf(u_img);
+        int x0 = (int)floorf(x), y0 = (int)floorf(y);
+        float fx = x - x0, fy = y - y0;
 
-        float pv = v_img - v0;
-        float pu = u_img - u0;
+        uint32_t c00 = fetch(level, x0, y0);
+        uint32_t c10 = fetch(level, x0 + 1, y0);
+        uint32_t c01 = fetch(level, x0, y0 + 1);
+        uint32_t c11 = fetch(level, x0 + 1, y0 + 1);
 
-        auto color00 = image_data.at<cv::Vec3b>(v0, u0);
-        auto color10 = image_data.at<cv::Vec3b>(v0, u1);
-        auto c0 = lerp(pu, color00, color10);
+        Eigen::Vector3f color;
+        for (int c = 0; c < 3; c++)
+        {
+            float top = channel(c00, c) + (channel(c10, c) - channel(c00, c)) * fx;
+            float bottom = channel(c01, c) + (channel(c11, c) - channel(c01, c)) * fx;
+            color[c] = top + (bottom - top) * fy;
+        }
+        return color;
+    }
 
-        auto color01 = image_data.at<cv::Vec3b>(v1, u0);
-        auto color11 = image_data.at<cv::Vec3b>(v1, u1);
-        auto c1 = lerp(pu, color01, color11);
+    // Isotropic level of detail of a pixel footprint given by the screen space UV derivatives
+    float mipLod(const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy) const
+    {
+        float major = std::max(footprint(duv_dx), footprint(duv_dy));
+        float lod = major > 0 ? log2f(major) : 0;
+        return std::clamp(lod, 0.f, (float)(mipLevels() - 1));
+    }
 
-        auto color = lerp(pv, c0, c1);
+    // Trilinear lookup with the level chosen from the screen space UV derivatives. With
+    // max_anisotropy > 1 up to that many trilinear taps are spread along the longer axis of the
+    // footprint and the level is chosen from the shorter one.
+    Eigen::Vector3f getColorTrilinear(float u, float v, const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy) const
+    {
+        float len_x = footprint(duv_dx);
+        float len_y = footprint(duv_dy);
+        float major = std::max(len_x, len_y);
+        float minor = std::min(len_x, len_y);
+        const Eigen::Vector2f& major_axis = len_x >= len_y ? duv_dx : duv_dy;
 
-        // std::cout << v0 << " " << v1 << " " << pv << std::endl;
-        // std::cout << u0 << " " << u1 << " " << pu << std::endl;
-        // std::cout << "1" << color00 << " " << color10 << " " << c0 << std::endl;
-        // std::cout << "2" << color01 << " " << color11 << " " << c1 << std::endl;
-        // std::cout << "3" << c0 << " " << c1 << " " << color << std::endl;
+        int taps = 1;
+        if (max_anisotropy > 1 && minor > 0)
+        {
+            taps = std::min(max_anisotropy, (int)ceilf(major / minor));
+        }
 
-        return Eigen::Vector3f(color[0], color[1], color[2]);
+        float lod = major > 0 ? log2f(major / taps) : 0;
+        lod = std::clamp(lod, 0.f, (float)(mipLevels() - 1));
+        int level = (int)lod;
+        float frac = lod - level;
+
+        Eigen::Vector3f color = Eigen::Vector3f::Zero();
+        for (int i = 0; i < taps; i++)
+        {
+            float offset = taps > 1 ? (i + 0.5f) / taps - 0.5f : 0;
+            float tu = u + major_axis.x() * offset;
+            float tv = v + major_axis.y() * offset;
+
+            Eigen::Vector3f c = getColorLevel(tu, tv, level);
+            if (frac > 0)
+            {
+                c += (getColorLevel(tu, tv, level + 1) - c) * frac;
+            }
+            color += c;
+        }
+        return color / taps;
     }
+
+    // Trilinear lookups of up to SAMPLE_BATCH lanes at the given levels of detail (see mipLod);
+    // lane i is sampled when bit i of active is set and gets the same color getColorTrilinear
+    // returns for it without anisotropy. Uses AVX2 gathers when the CPU has them.
+    void sampleTrilinear(const float u[SAMPLE_BATCH], const float v[SAMPLE_BATCH], const float lod[SAMPLE_BATCH],
+                         unsigned active, float colors[3][SAMPLE_BATCH]) const;
 };
 #endif //RASTERIZER_TEXTURE_H
@@ -18,6 +18,10 @@ Triangle::Triangle() {
     tex_coords[0] << 0.0, 0.0;
     tex_coords[1] << 0.0, 0.0;
     tex_coords[2] << 0.0, 0.0;
+
+    tangent[0] << 0.0, 0.0, 0.0, 1.0;
+    tangent[1] << 0.0, 0.0, 0.0, 1.0;
+    tangent[2] << 0.0, 0.0, 0.0, 1.0;
 }
 
 void Triangle::setVertex(int ind, Vector4f ver){
@@ -41,6 +45,9 @@ void Triangle::setColor(int ind, float r, float g, float b) {
 void Triangle::setTexCoord(int ind, Vector2f uv) {
     tex_coords[ind] = uv;
 }
+void Triangle::setTangent(int ind, Vector4f t) {
+    tangent[ind] = t;
+}
 
 std::array<Vector4f, 3> Triangle::toVector4() const
 {
@@ -17,6 +17,7 @@ public:
     Vector3f color[3]; //color at each vertex;
     Vector2f tex_coords[3]; //texture u,v
     Vector3f normal[3]; //normal vector for each vertex
+    Vector4f tangent[3]; //tangent for each vertex, w is the sign of the bitangent n x t
 
     Texture *tex= nullptr;
     Triangle();
@@ -32,6 +33,7 @@ public:
     void setNormals(const std::array<Vector3f, 3>& normals);
     void setColors(const std::array<Vector3f, 3>& colors);
     void setTexCoord(int ind,Vector2f uv ); /*set i-th vertex texture coordinate*/
+    void setTangent(int ind, Vector4f t); /*set i-th vertex tangent and bitangent sign*/
     std::array<Vector4f, 3> toVector4() const;
 };
 
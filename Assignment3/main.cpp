@@ -1,13 +1,55 @@
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <map>
+#include <new>
+#include <random>
+#include <thread>
 #include <opencv2/opencv.hpp>
 
 #include "global.hpp"
 #include "rasterizer.hpp"
 #include "Triangle.hpp"
+#include "Mesh.hpp"
+#include "ImageWriter.hpp"
 #include "Shader.hpp"
 #include "Texture.hpp"
 #include "OBJ_Loader.h"
 
+// Heap allocations made through operator new, reported by the benchmark. Only counted in builds
+// configured with RASTERIZER_COUNT_ALLOCATIONS (see CMakeLists.txt).
+static std::atomic<uint64_t> allocation_count{0};
+
+#ifdef RST_COUNT_ALLOCATIONS
+// Kept out of line: once inlined, GCC pairs the malloc/free inside with new/delete expressions
+// and reports them as mismatched
+#if defined(__GNUC__)
+#define RST_NOINLINE __attribute__((noinline))
+#else
+#define RST_NOINLINE
+#endif
+
+RST_NOINLINE void* operator new(std::size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+RST_NOINLINE void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+RST_NOINLINE void operator delete(void* p, std::size_t) noexcept
+{
+    ::operator delete(p);
+}
+#endif
+
 Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
 {
     Eigen::Matrix4f view = Eigen::Matrix4f::Identity();
@@ -99,12 +141,6 @@ static Eigen::Vector3f reflect(const Eigen::Vector3f& vec, const Eigen::Vector3f
     return (2 * costheta * axis - vec).normalized();
 }
 
-struct light
-{
-    Eigen::Vector3f position;
-    Eigen::Vector3f intensity;
-};
-
 Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 {
     Eigen::Vector3f return_color = {0, 0, 0};
@@ -116,21 +152,20 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
     {
         // TODO: Get the texture value at the texture coordinates of the current fragment
         // texture_color = payload.texture->getColor(payload.tex_coords.x(), payload.tex_coords.y());
-        texture_color = payload.texture->getColorBiLinear(payload.tex_coords.x(), payload.tex_coords.y());
+        // texture_color = payload.texture->getColorBiLinear(payload.tex_coords.x(), payload.tex_coords.y());
+        texture_color = payload.texture->getColorTrilinear(payload.tex_coords.x(), payload.tex_coords.y(), payload.tex_coords_dx, payload.tex_coords_dy);
     }
 
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    const shader_uniforms& uniforms = *payload.uniforms;
+    const Eigen::Vector3f& ka = uniforms.material.ka;
     Eigen::Vector3f kd = texture_color / 255.f;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
+    const Eigen::Vector3f& ks = uniforms.material.ks;
 
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
+    const std::vector<light>& lights = uniforms.lighting.lights;
+    const Eigen::Vector3f& amb_light_intensity = uniforms.lighting.ambient;
+    const Eigen::Vector3f& eye_pos = uniforms.camera.eye_pos;
 
-    float p = 150;
+    float p = uniforms.material.p;
 
     Eigen::Vector3f color = texture_color;
     Eigen::Vector3f point = payload.view_pos;
@@ -138,8 +173,11 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 
     Eigen::Vector3f result_color = {0, 0, 0};
 
-    for (auto& light : lights)
+    // Ambient once, then the lights listed for this fragment
+    result_color += ka.cwiseProduct(amb_light_intensity);
+    for (int index : payload.lights)
     {
+        const auto& light = lights[index];
         // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
         // components are. Then, accumulate that result on the *result_color* object.
         float r2 = (point - light.position).norm() * (point - light.position).norm();
@@ -149,7 +187,8 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
         auto half = (view + l).normalized();
         float ndoth = normal.dot(half) < 0 ? 0 : normal.dot(half);
 
-        result_color += ka.cwiseProduct(amb_light_intensity) + kd.cwiseProduct(light.intensity) / r2 * ndotl + ks.cwiseProduct(light.intensity)/r2 * powf(ndoth, p);
+        Eigen::Vector3f intensity = light.intensity * light_falloff(light, r2);
+        result_color += kd.cwiseProduct(intensity) / r2 * ndotl + ks.cwiseProduct(intensity)/r2 * powf(ndoth, p);
     }
 
     return result_color * 255.f;
@@ -157,26 +196,27 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 
 Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
 {
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    const shader_uniforms& uniforms = *payload.uniforms;
+    const Eigen::Vector3f& ka = uniforms.material.ka;
     Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
+    const Eigen::Vector3f& ks = uniforms.material.ks;
 
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
+    const std::vector<light>& lights = uniforms.lighting.lights;
+    const Eigen::Vector3f& amb_light_intensity = uniforms.lighting.ambient;
+    const Eigen::Vector3f& eye_pos = uniforms.camera.eye_pos;
 
-    float p = 150;
+    float p = uniforms.material.p;
 
     Eigen::Vector3f color = payload.color;
     Eigen::Vector3f point = payload.view_pos;
     Eigen::Vector3f normal = payload.normal;
 
     Eigen::Vector3f result_color = {0, 0, 0};
-    for (auto& light : lights)
+    // Ambient once, then the lights listed for this fragment
+    result_color += ka.cwiseProduct(amb_light_intensity);
+    for (int index : payload.lights)
     {
+        const auto& light = lights[index];
         // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
         // components are. Then, accumulate that result on the *result_color* object.
         
@@ -187,7 +227,8 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
         auto half = (view + l).normalized();
         float ndoth = normal.dot(half) < 0 ? 0 : normal.dot(half);
 
-        result_color += ka.cwiseProduct(amb_light_intensity) + kd.cwiseProduct(light.intensity) / r2 * ndotl + ks.cwiseProduct(light.intensity)/r2 * powf(ndoth, p);
+        Eigen::Vector3f intensity = light.intensity * light_falloff(light, r2);
+        result_color += kd.cwiseProduct(intensity) / r2 * ndotl + ks.cwiseProduct(intensity)/r2 * powf(ndoth, p);
     }
 
     return result_color * 255.f;
@@ -195,61 +236,223 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
 
 
 
+// Eigen reduces a 3-vector as x + (y + z); the batch shaders sum in the same order so they match the
+// per fragment shaders bit for bit
+static inline float sum3(float x, float y, float z)
+{
+    return x + (y + z);
+}
+
+// Lighting of phong_fragment_shader and texture_fragment_shader over a batch with diffuse color kd:
+// every step is a loop over the lanes, so the compiler can run it on SIMD registers
+static void blinn_phong_batch(const fragment_batch& batch, const float kd[3][FRAGMENT_BATCH_SIZE], float colors[3][FRAGMENT_BATCH_SIZE])
+{
+    const int N = FRAGMENT_BATCH_SIZE;
+
+    const shader_uniforms& uniforms = *batch.uniforms;
+    const Eigen::Vector3f& ka = uniforms.material.ka;
+    const Eigen::Vector3f& ks = uniforms.material.ks;
+    const Eigen::Vector3f& amb_light_intensity = uniforms.lighting.ambient;
+    const Eigen::Vector3f& eye_pos = uniforms.camera.eye_pos;
+
+    float p = uniforms.material.p;
+
+    // Ambient once, then the lights listed for the batch
+    float result[3][N];
+    for (int c = 0; c < 3; c++)
+    {
+        for (int i = 0; i < N; i++)
+        {
+            result[c][i] = ka[c] * amb_light_intensity[c];
+        }
+    }
+    for (int index : batch.lights)
+    {
+        const light& light = uniforms.lighting.lights[index];
+        const Eigen::Vector3f& lp = light.position;
+        float r2[N], falloff[N], l[3][N], ndotl[N], half[3][N], ndoth[N], spec[N];
+        for (int i = 0; i < N; i++)
+        {
+            float dx = batch.view_pos[0][i] - lp[0], dy = batch.view_pos[1][i] - lp[1], dz = batch.view_pos[2][i] - lp[2];
+            float dist = std::sqrt(sum3(dx * dx, dy * dy, dz * dz));
+            r2[i] = dist * dist;
+            falloff[i] = light_falloff(light, r2[i]);
+        }
+        for (int i = 0; i < N; i++)
+        {
+            float lx = lp[0] - batch.view_pos[0][i], ly = lp[1] - batch.view_pos[1][i], lz = lp[2] - batch.view_pos[2][i];
+            float len2 = sum3(lx * lx, ly * ly, lz * lz);
+            float len = len2 > 0 ? std::sqrt(len2) : 1;
+            l[0][i] = len2 > 0 ? lx / len : lx;
+            l[1][i] = len2 > 0 ? ly / len : ly;
+            l[2][i] = len2 > 0 ? lz / len : lz;
+
+            float d = sum3(batch.normal[0][i] * l[0][i], batch.normal[1][i] * l[1][i], batch.normal[2][i] * l[2][i]);
+            ndotl[i] = d < 0 ? 0 : d;
+        }
+        for (int i = 0; i < N; i++)
+        {
+            float vx = eye_pos[0] - batch.view_pos[0][i], vy = eye_pos[1] - batch.view_pos[1][i], vz = eye_pos[2] - batch.view_pos[2][i];
+            float vlen2 = sum3(vx * vx, vy * vy, vz * vz);
+            float vlen = vlen2 > 0 ? std::sqrt(vlen2) : 1;
+            if (vlen2 > 0)
+            {
+                vx /= vlen; vy /= vlen; vz /= vlen;
+            }
+
+            float hx = vx + l[0][i], hy = vy + l[1][i], hz = vz + l[2][i];
+            float hlen2 = sum3(hx * hx, hy * hy, hz * hz);
+            float hlen = hlen2 > 0 ? std::sqrt(hlen2) : 1;
+            half[0][i] = hlen2 > 0 ? hx / hlen : hx;
+            half[1][i] = hlen2 > 0 ? hy / hlen : hy;
+            half[2][i] = hlen2 > 0 ? hz / hlen : hz;
+
+            float d = sum3(batch.normal[0][i] * half[0][i], batch.normal[1][i] * half[1][i], batch.normal[2][i] * half[2][i]);
+            ndoth[i] = d < 0 ? 0 : d;
+        }
+        // powf has no vector form, keep it out of the other loops
+        for (int i = 0; i < N; i++)
+        {
+            spec[i] = (batch.active >> i) & 1 ? powf(ndoth[i], p) : 0;
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            for (int i = 0; i < N; i++)
+            {
+                float intensity = light.intensity[c] * falloff[i];
+                result[c][i] += kd[c][i] * intensity / r2[i] * ndotl[i] + ks[c] * intensity / r2[i] * spec[i];
+            }
+        }
+    }
+
+    for (int c = 0; c < 3; c++)
+    {
+        for (int i = 0; i < N; i++)
+        {
+            colors[c][i] = result[c][i] * 255.f;
+        }
+    }
+}
+
+void phong_fragment_shader_batch(const fragment_batch& batch, float colors[3][FRAGMENT_BATCH_SIZE])
+{
+    blinn_phong_batch(batch, batch.color, colors);
+}
+
+void texture_fragment_shader_batch(const fragment_batch& batch, float colors[3][FRAGMENT_BATCH_SIZE])
+{
+    const int N = FRAGMENT_BATCH_SIZE;
+
+    float kd[3][N] = {};
+    if (batch.texture)
+    {
+        float texture_color[3][N];
+        if (batch.texture->max_anisotropy > 1)
+        {
+            for (int i = 0; i < N; i++)
+            {
+                if (!((batch.active >> i) & 1))
+                    continue;
+                Eigen::Vector3f color = batch.texture->getColorTrilinear(batch.tex_coords[0][i], batch.tex_coords[1][i],
+                                                                         {batch.tex_coords_dx[0][i], batch.tex_coords_dx[1][i]},
+                                                                         {batch.tex_coords_dy[0][i], batch.tex_coords_dy[1][i]});
+                for (int c = 0; c < 3; c++)
+                    texture_color[c][i] = color[c];
+            }
+        }
+        else
+        {
+            float lod[N] = {};
+            for (int i = 0; i < N; i++)
+            {
+                if ((batch.active >> i) & 1)
+                    lod[i] = batch.texture->mipLod({batch.tex_coords_dx[0][i], batch.tex_coords_dx[1][i]},
+                                                   {batch.tex_coords_dy[0][i], batch.tex_coords_dy[1][i]});
+            }
+            batch.texture->sampleTrilinear(batch.tex_coords[0], batch.tex_coords[1], lod, batch.active, texture_color);
+        }
+
+        for (int c = 0; c < 3; c++)
+        {
+            for (int i = 0; i < N; i++)
+            {
+                kd[c][i] = texture_color[c][i] / 255.f;
+            }
+        }
+    }
+    blinn_phong_batch(batch, kd, colors);
+}
+
+// Normal of the tangent space normal ln = (x, y, z), i.e. normalize(TBN * ln) with TBN = [t b n].
+// t is the interpolated mesh tangent and b = sign * n x t. Meshes without usable UVs have no
+// tangent, those fall back to a t made up from the normal alone.
+static Eigen::Vector3f tangent_to_view(const fragment_shader_payload& payload, const Eigen::Vector3f& ln)
+{
+    const Eigen::Vector3f& n = payload.normal;
+    Eigen::Vector3f t = payload.tangent.head<3>();
+    float sign = payload.tangent.w();
+    if (t.squaredNorm() > 1e-12f)
+    {
+        t.normalize();
+    }
+    else
+    {
+        t = Eigen::Vector3f(n.x()*n.y()/sqrt(n.x()*n.x()+n.z()*n.z()),sqrt(n.x()*n.x()+n.z()*n.z()),n.z()*n.y()/sqrt(n.x()*n.x()+n.z()*n.z()));
+        sign = 1;
+    }
+    Eigen::Vector3f b = sign * n.cross(t);
+    return (t * ln.x() + b * ln.y() + n * ln.z()).normalized();
+}
+
 Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payload)
 {
     
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    const shader_uniforms& uniforms = *payload.uniforms;
+    const Eigen::Vector3f& ka = uniforms.material.ka;
     Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
+    const Eigen::Vector3f& ks = uniforms.material.ks;
 
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
+    const std::vector<light>& lights = uniforms.lighting.lights;
+    const Eigen::Vector3f& amb_light_intensity = uniforms.lighting.ambient;
+    const Eigen::Vector3f& eye_pos = uniforms.camera.eye_pos;
 
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
+    float p = uniforms.material.p;
 
     Eigen::Vector3f color = payload.color; 
     Eigen::Vector3f point = payload.view_pos;
     Eigen::Vector3f normal = payload.normal;
 
-    float kh = 0.2, kn = 0.1;
+    float kh = uniforms.material.kh, kn = uniforms.material.kn;
     
     // TODO: Implement displacement mapping here
     // Let n = normal = (x, y, z)
-    // Vector t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
-    // Vector b = n cross product t
+    // Vector t = interpolated mesh tangent, see compute_tangents
+    // Vector b = sign * n cross product t
     // Matrix TBN = [t b n]
     // dU = kh * kn * (h(u+1/w,v)-h(u,v))
     // dV = kh * kn * (h(u,v+1/h)-h(u,v))
     // Vector ln = (-dU, -dV, 1)
     // Position p = p + kn * n * h(u,v)
     // Normal n = normalize(TBN * ln)
-    auto n = payload.normal;
-    auto t = Eigen::Vector3f(n.x()*n.y()/sqrt(n.x()*n.x()+n.z()*n.z()),sqrt(n.x()*n.x()+n.z()*n.z()),n.z()*n.y()/sqrt(n.x()*n.x()+n.z()*n.z()));
-    auto b = n.cross(t);
-    Eigen::Matrix3f TBN;
-    TBN <<  t.x(), b.x(), n.x(),
-            t.y(), b.y(), n.y(),
-            t.z(), b.z(), n.z();
 
     float u = payload.tex_coords.x();
     float v = payload.tex_coords.y();
-    float w = payload.texture->width;
-    float h = payload.texture->height;
 
-    auto dU = kh * kn * (payload.texture->getColor(u+1/w, v).norm() - payload.texture->getColor(u, v).norm());
-    auto dV = kh * kn * (payload.texture->getColor(u,v+1/h).norm() - payload.texture->getColor(u,v).norm());
+    // h(u,v), h(u+1/w,v)-h(u,v) and h(u,v+1/h)-h(u,v) in one fetch
+    const float* height = uniforms.material.height_field->getTexel(u, v);
+    auto dU = kh * kn * height[1];
+    auto dV = kh * kn * height[2];
     auto ln = Vector3f(-dU, -dV, 1.0f);
-    point = point + kn * normal * payload.texture->getColor(u,v).norm();
-    normal = (TBN * ln).normalized();
+    point = point + kn * normal * height[0];
+    normal = tangent_to_view(payload, ln);
 
     Eigen::Vector3f result_color = {0, 0, 0};
 
-    for (auto& light : lights)
+    // Ambient once, then the lights listed for this fragment
+    result_color += ka.cwiseProduct(amb_light_intensity);
+    for (int index : payload.lights)
     {
+        const auto& light = lights[index];
         // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
         // components are. Then, accumulate that result on the *result_color* object.
         float r2 = (point - light.position).norm() * (point - light.position).norm();
@@ -259,7 +462,8 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
         auto half = (view + l).normalized();
         float ndoth = normal.dot(half) < 0 ? 0 : normal.dot(half);
 
-        result_color += ka.cwiseProduct(amb_light_intensity) + kd.cwiseProduct(light.intensity) / r2 * ndotl + ks.cwiseProduct(light.intensity)/r2 * powf(ndoth, p);
+        Eigen::Vector3f intensity = light.intensity * light_falloff(light, r2);
+        result_color += kd.cwiseProduct(intensity) / r2 * ndotl + ks.cwiseProduct(intensity)/r2 * powf(ndoth, p);
 
     }
 
@@ -270,97 +474,214 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
 Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
 {
     
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
-    Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
-
-    Eigen::Vector3f color = payload.color; 
-    Eigen::Vector3f point = payload.view_pos;
+    const shader_uniforms& uniforms = *payload.uniforms;
     Eigen::Vector3f normal = payload.normal;
 
 
-    float kh = 0.2, kn = 0.1;
+    float kh = uniforms.material.kh, kn = uniforms.material.kn;
 
     // TODO: Implement bump mapping here
     // Let n = normal = (x, y, z)
-    // Vector t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
-    // Vector b = n cross product t
+    // Vector t = interpolated mesh tangent, see compute_tangents
+    // Vector b = sign * n cross product t
     // Matrix TBN = [t b n]
     // dU = kh * kn * (h(u+1/w,v)-h(u,v))
     // dV = kh * kn * (h(u,v+1/h)-h(u,v))
     // Vector ln = (-dU, -dV, 1)
     // Normal n = normalize(TBN * ln)
 
-    auto n = payload.normal;
-    auto t = Eigen::Vector3f(n.x()*n.y()/sqrt(n.x()*n.x()+n.z()*n.z()),sqrt(n.x()*n.x()+n.z()*n.z()),n.z()*n.y()/sqrt(n.x()*n.x()+n.z()*n.z()));
-    auto b = n.cross(t);
-    Eigen::Matrix3f TBN;
-    TBN <<  t.x(), b.x(), n.x(),
-            t.y(), b.y(), n.y(),
-            t.z(), b.z(), n.z();
 
     float u = payload.tex_coords.x();
     float v = payload.tex_coords.y();
-    float w = payload.texture->width;
-    float h = payload.texture->height;
 
-    auto dU = kh * kn * (payload.texture->getColor(u+1/w, v).norm() - payload.texture->getColor(u, v).norm());
-    auto dV = kh * kn * (payload.texture->getColor(u,v+1/h).norm() - payload.texture->getColor(u,v).norm());
+    // h(u+1/w,v)-h(u,v) and h(u,v+1/h)-h(u,v) in one fetch
+    const float* height = uniforms.material.height_field->getTexel(u, v);
+    auto dU = kh * kn * height[1];
+    auto dV = kh * kn * height[2];
     auto ln = Vector3f(-dU, -dV, 1.0f);
-    normal = (TBN * ln).normalized();
+    normal = tangent_to_view(payload, ln);
 
     // Eigen::Vector3f return_color = (normal + Eigen::Vector3f(1.0f, 1.0f, 1.0f)) / 2.f;
     Eigen::Vector3f return_color = normal;
     return return_color * 255.f;
 }
 
-int main(int argc, const char** argv)
+// Runtime selectable fragment shaders, each with its compile-time specialized span shader
+struct shader_entry
 {
-    std::vector<Triangle*> TriangleList;
+    const char* name;
+    Eigen::Vector3f (*shader)(const fragment_shader_payload&);
+    fragment_span_shader specialized;
+    fragment_batch_shader batched; // nullptr if the shader has no batch form
+    Varyings varyings;             // payload fields the shader reads
+};
 
-    float angle = 135.0;
-    bool command_line = false;
+static const shader_entry shaders[] = {
+    {"normal", normal_fragment_shader, shade_span<normal_fragment_shader>, nullptr,
+     Varyings::Normal},
+    {"phong", phong_fragment_shader, shade_span<phong_fragment_shader>, phong_fragment_shader_batch,
+     Varyings::Color | Varyings::Normal | Varyings::ViewPos},
+    {"texture", texture_fragment_shader, shade_span<texture_fragment_shader>, texture_fragment_shader_batch,
+     Varyings::Normal | Varyings::TexCoords | Varyings::TexDerivatives | Varyings::ViewPos},
+    {"bump", bump_fragment_shader, shade_span<bump_fragment_shader>, nullptr,
+     Varyings::Normal | Varyings::TexCoords | Varyings::Tangent},
+    {"displacement", displacement_fragment_shader, shade_span<displacement_fragment_shader>, nullptr,
+     Varyings::Color | Varyings::Normal | Varyings::TexCoords | Varyings::ViewPos | Varyings::Tangent},
+};
 
-    std::string filename = "output.png";
-    objl::Loader Loader;
-    std::string obj_path = "../models/spot/";
+static const shader_entry* find_shader(const std::string& name)
+{
+    for (const auto& entry : shaders)
+    {
+        if (name == entry.name)
+            return &entry;
+    }
+    return nullptr;
+}
 
-    // Load .obj File
+// Per vertex tangents of an indexed mesh: each triangle adds the directions of increasing u and v
+// to its vertices, the sum is then made orthogonal to the normal. w is +1 or -1 so that
+// b = w * n x t points along increasing v, which flips on mirrored UVs. Vertices without a usable
+// UV mapping get a zero tangent.
+static std::vector<Eigen::Vector4f> compute_tangents(const std::vector<Eigen::Vector3f>& positions,
+                                                     const std::vector<Eigen::Vector3f>& normals,
+                                                     const std::vector<Eigen::Vector2f>& tex_coords,
+                                                     const std::vector<Eigen::Vector3i>& indices)
+{
+    std::vector<Eigen::Vector3f> tan_u(positions.size(), Eigen::Vector3f::Zero());
+    std::vector<Eigen::Vector3f> tan_v(positions.size(), Eigen::Vector3f::Zero());
+    for (const auto& ind : indices)
+    {
+        Eigen::Vector3f e1 = positions[ind[1]] - positions[ind[0]];
+        Eigen::Vector3f e2 = positions[ind[2]] - positions[ind[0]];
+        Eigen::Vector2f d1 = tex_coords[ind[1]] - tex_coords[ind[0]];
+        Eigen::Vector2f d2 = tex_coords[ind[2]] - tex_coords[ind[0]];
+
+        float det = d1.x() * d2.y() - d2.x() * d1.y();
+        if (std::abs(det) < 1e-12f)
+            continue;
+        Eigen::Vector3f sdir = (e1 * d2.y() - e2 * d1.y()) / det;
+        Eigen::Vector3f tdir = (e2 * d1.x() - e1 * d2.x()) / det;
+        for (int j = 0; j < 3; j++)
+        {
+            tan_u[ind[j]] += sdir;
+            tan_v[ind[j]] += tdir;
+        }
+    }
+
+    std::vector<Eigen::Vector4f> tangents(positions.size());
+    for (size_t i = 0; i < positions.size(); i++)
+    {
+        Eigen::Vector3f n = normals[i].normalized();
+        Eigen::Vector3f t = tan_u[i] - n * n.dot(tan_u[i]);
+        if (t.squaredNorm() < 1e-12f)
+        {
+            tangents[i] = Eigen::Vector4f(0, 0, 0, 1);
+            continue;
+        }
+        t.normalize();
+        float w = n.cross(t).dot(tan_v[i]) < 0 ? -1.0f : 1.0f;
+        tangents[i] << t, w;
+    }
+    return tangents;
+}
+
+// Indexed mesh of an .obj file. The loader repeats every shared vertex per face, keep one entry
+// per unique position/normal/uv so the vertex shader runs once for it. The loader and the
+// temporary arrays are gone once the mesh is built.
+static Mesh load_mesh(const std::string& obj_file)
+{
+    objl::Loader Loader;
     // bool loadout = Loader.LoadFile("../models/spot/spot_triangulated_good.obj");
-    bool loadout = Loader.LoadFile("../models/bunny/bunny.obj");
+    bool loadout = Loader.LoadFile(obj_file);
     // bool loadout = Loader.LoadFile("../models/cube/cube.obj");
     // bool loadout = Loader.LoadFile("../models/suzanne/suzanne.obj");
-
     std::cout << loadout << std::endl;
-    for(auto mesh:Loader.LoadedMeshes)
+
+    std::vector<Eigen::Vector3f> positions;
+    std::vector<Eigen::Vector3f> normals;
+    std::vector<Eigen::Vector2f> tex_coords;
+    std::vector<Eigen::Vector3i> indices;
+    std::map<std::array<float, 8>, int> vertex_index;
+    for (const auto& mesh : Loader.LoadedMeshes)
     {
-        for(int i=0;i<mesh.Vertices.size();i+=3)
+        for (size_t i = 0; i < mesh.Vertices.size(); i += 3)
         {
-            Triangle* t = new Triangle();
-            for(int j=0;j<3;j++)
+            Eigen::Vector3i ind;
+            for (int j = 0; j < 3; j++)
             {
-                t->setVertex(j,Vector4f(mesh.Vertices[i+j].Position.X,mesh.Vertices[i+j].Position.Y,mesh.Vertices[i+j].Position.Z,1.0));
-                t->setNormal(j,Vector3f(mesh.Vertices[i+j].Normal.X,mesh.Vertices[i+j].Normal.Y,mesh.Vertices[i+j].Normal.Z));
-                t->setTexCoord(j,Vector2f(mesh.Vertices[i+j].TextureCoordinate.X, mesh.Vertices[i+j].TextureCoordinate.Y));
+                const auto& vertex = mesh.Vertices[i + j];
+                Eigen::Vector3f p(vertex.Position.X, vertex.Position.Y, vertex.Position.Z);
+                Eigen::Vector3f n(vertex.Normal.X, vertex.Normal.Y, vertex.Normal.Z);
+                Eigen::Vector2f uv(vertex.TextureCoordinate.X, vertex.TextureCoordinate.Y);
+                auto inserted = vertex_index.emplace(std::array<float, 8>{p.x(), p.y(), p.z(), n.x(), n.y(), n.z(), uv.x(), uv.y()}, (int)positions.size());
+                if (inserted.second)
+                {
+                    positions.push_back(p);
+                    normals.push_back(n);
+                    tex_coords.push_back(uv);
+                }
+                ind[j] = inserted.first->second;
             }
-            TriangleList.push_back(t);
+            indices.push_back(ind);
         }
     }
 
+    // Shared vertices get the tangent of all their faces, so the bump frame is smooth across them
+    std::vector<Eigen::Vector4f> tangents = compute_tangents(positions, normals, tex_coords, indices);
+
+    Mesh result((int)positions.size(), (int)indices.size());
+    std::copy(positions.begin(), positions.end(), result.positions());
+    std::copy(normals.begin(), normals.end(), result.normals());
+    std::copy(tex_coords.begin(), tex_coords.end(), result.texCoords());
+    std::copy(tangents.begin(), tangents.end(), result.tangents());
+    std::copy(indices.begin(), indices.end(), result.indices());
+    return result;
+}
+
+int main(int argc, const char** argv)
+{
+    float angle = 135.0;
+    bool command_line = false;
+    bool bench = false;
+    int many_lights = 0;
+    int sequence_frames = 0;
+
+    std::string filename = "output.png";
+    std::string obj_path = "../models/spot/";
+
+    // Load .obj File
+    std::string obj_file = "../models/bunny/bunny.obj";
+    // Rasterizer output.png bench [model.obj]
+    if (argc >= 4 && std::string(argv[2]) == "bench")
+    {
+        obj_file = argv[3];
+    }
+    // Rasterizer output.png lights [count] [model.obj]
+    if (argc >= 5 && std::string(argv[2]) == "lights")
+    {
+        obj_file = argv[4];
+    }
+
+    Mesh mesh = load_mesh(obj_file);
+
     rst::rasterizer r(700, 700);
+    r.set_thread_count(std::thread::hardware_concurrency());
     auto texture_path = "hmap.jpg";
-    r.set_texture(Texture(obj_path + texture_path));
+    Texture height_map(obj_path + texture_path);
+    Texture::Derived height_field = height_map.bakeHeightGradients();
+    r.set_texture(height_map);
 
-    std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = phong_fragment_shader;
+    light_block lighting;
+    lighting.lights = {light{{20, 20, 20}, {500, 500, 500}}, light{{-20, 20, 0}, {500, 500, 500}}};
+    lighting.ambient = {20, 20, 20};
+    r.set_lights(lighting);
+    r.set_camera(camera_block{{0, 0, 10}});
+    material_block material;
+    material.height_field = &height_field;
+    r.set_material(material);
+
+    const shader_entry* active_shader = find_shader("phong");
 
     if (argc >= 2)
     {
@@ -370,7 +691,7 @@ int main(int argc, const char** argv)
         if (argc >= 3 && std::string(argv[2]) == "texture")
         {
             std::cout << "Rasterizing using the texture shader\n";
-            active_shader = texture_fragment_shader;
+            active_shader = find_shader("texture");
             texture_path = "spot_texture.png";
             if (argc >= 4)
             {
@@ -383,33 +704,55 @@ int main(int argc, const char** argv)
         else if (argc == 3 && std::string(argv[2]) == "normal")
         {
             std::cout << "Rasterizing using the normal shader\n";
-            active_shader = normal_fragment_shader;
+            active_shader = find_shader("normal");
         }
         else if (argc == 3 && std::string(argv[2]) == "phong")
         {
             std::cout << "Rasterizing using the phong shader\n";
-            active_shader = phong_fragment_shader;
+            active_shader = find_shader("phong");
         }
         else if (argc == 3 && std::string(argv[2]) == "bump")
         {
             std::cout << "Rasterizing using the bump shader\n";
-            active_shader = bump_fragment_shader;
+            active_shader = find_shader("bump");
         }
         else if (argc == 3 && std::string(argv[2]) == "displacement")
         {
             std::cout << "Rasterizing using the bump shader\n";
-            active_shader = displacement_fragment_shader;
+            active_shader = find_shader("displacement");
+        }
+        else if (argc >= 3 && std::string(argv[2]) == "bench")
+        {
+            std::cout << "Benchmarking " << obj_file << " with the normal shader\n";
+            active_shader = find_shader("normal");
+            bench = true;
+        }
+        else if (argc >= 3 && std::string(argv[2]) == "lights")
+        {
+            many_lights = argc >= 4 ? std::max(1, std::atoi(argv[3])) : 256;
+            std::cout << "Rasterizing " << obj_file << " lit by " << many_lights << " point lights\n";
+            active_shader = find_shader("phong");
+        }
+        // Rasterizer output.png frames [count]: turntable written as output_0000.png ...
+        else if (argc >= 3 && std::string(argv[2]) == "frames")
+        {
+            sequence_frames = argc >= 4 ? std::max(1, std::atoi(argv[3])) : 36;
+            std::cout << "Rasterizing a turntable of " << sequence_frames << " frames using the phong shader\n";
+            active_shader = find_shader("phong");
         }
     }
     else
     {
-        active_shader = normal_fragment_shader;
+        active_shader = find_shader("normal");
     }
     
     Eigen::Vector3f eye_pos = {0,0,10};
 
     r.set_vertex_shader(vertex_shader);
-    r.set_fragment_shader(active_shader);
+    if (active_shader->batched)
+        r.set_fragment_shader(active_shader->batched, active_shader->varyings);
+    else
+        r.set_fragment_shader(active_shader->specialized, active_shader->varyings);
 
     int key = 0;
     int frame_count = 0;
@@ -431,24 +774,213 @@ int main(int argc, const char** argv)
     std::cout << "vp:" << std::endl;
     std::cout << vp << std::endl;
 
-    if (command_line)
+    if (bench)
     {
-        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+        const int frames = 50;
         r.set_model(get_model_matrix(angle));
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-        r.draw(TriangleList);
+        // The mesh against one heap allocated Triangle per face
+        Mesh triangle_list = mesh.unindexed();
+        std::cout << "mesh:             " << mesh.vertexCount() << " vertices, " << mesh.triangleCount() << " triangles, "
+                  << mesh.memoryBytes() / 1024 << " KB (" << mesh.triangleCount() * (sizeof(Triangle) + sizeof(Triangle*)) / 1024
+                  << " KB as Triangle objects)\n";
+
+        auto run = [&](const char* mode, bool indexed = true) {
+            auto frame = [&]() {
+                r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+                if (indexed)
+                    r.draw(mesh);
+                else
+                    r.draw(triangle_list);
+            };
+            // One frame first so buffers sized on first use are not counted
+            frame();
+            r.reset_stats();
+            uint64_t allocations = allocation_count;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < frames; i++)
+            {
+                frame();
+            }
+            auto stop = std::chrono::steady_clock::now();
+            allocations = allocation_count - allocations;
+
+            double seconds = std::chrono::duration<double>(stop - start).count();
+            auto stats = r.stats();
+            std::cout << "mode:             " << mode << "\n";
+            std::cout << "frames:           " << frames << "\n";
+            std::cout << "ms/frame:         " << seconds * 1000 / frames << "\n";
+            std::cout << "vertices/frame:   " << stats.vertices / frames << "\n";
+            std::cout << "fragments/frame:  " << stats.fragments / frames << "\n";
+            std::cout << "shaded/frame:     " << stats.shaded / frames << "\n";
+            std::cout << "Mfragments/s:     " << stats.fragments / seconds / 1e6 << "\n";
+            std::cout << "hi-z culled:      " << stats.hiz_culled_triangles / frames << " triangles, "
+                      << stats.hiz_culled_blocks / frames << " blocks per frame\n";
+            std::cout << "trivial blocks:   " << stats.rejected_blocks / frames << " rejected, "
+                      << stats.accepted_blocks / frames << " accepted per frame\n";
+#ifdef RST_COUNT_ALLOCATIONS
+            std::cout << "allocations/frame:" << (double)allocations / frames << "\n";
+#else
+            (void)allocations;
+            std::cout << "allocations/frame: not counted (RASTERIZER_COUNT_ALLOCATIONS is off)\n";
+#endif
+        };
+
+        r.set_simd(false);
+        run("scalar span kernel");
+        r.set_simd(true);
+        run(r.using_simd() ? "avx2 span kernel" : "scalar span kernel (no avx2)");
+        run("triangle list (no vertex reuse)", false);
+        r.set_deferred(true);
+        run("deferred shading");
+        r.set_deferred(false);
+        r.set_depth_prepass(true);
+        run("depth prepass");
+        r.set_depth_prepass(false);
+        r.set_visibility_buffer(true);
+        run("visibility buffer");
+        r.set_visibility_buffer(false);
+        r.set_front_to_back(true);
+        run("front to back");
+        run("front to back, triangle list", false);
+        r.set_front_to_back(false);
+
+        // Per shader: std::function called per fragment vs the specialized span shader
+        auto time_frames = [&]() {
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < frames; i++)
+            {
+                r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+                r.draw(mesh);
+            }
+            auto stop = std::chrono::steady_clock::now();
+            return std::chrono::duration<double>(stop - start).count() * 1000 / frames;
+        };
+
+        std::cout << "shader         std::function ms/frame   specialized ms/frame     prepass ms/frame         batched ms/frame\n";
+        for (const auto& entry : shaders)
+        {
+            r.set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)>(entry.shader), entry.varyings);
+            double dynamic_ms = time_frames();
+            r.set_fragment_shader(entry.specialized, entry.varyings);
+            double specialized_ms = time_frames();
+            r.set_depth_prepass(true);
+            double prepass_ms = time_frames();
+            r.set_depth_prepass(false);
+            std::cout << std::left << std::setw(15) << entry.name << std::setw(25) << dynamic_ms << std::setw(25) << specialized_ms
+                      << std::setw(25) << prepass_ms;
+            if (entry.batched)
+            {
+                r.set_fragment_shader(entry.batched, entry.varyings);
+                std::cout << time_frames();
+            }
+            std::cout << "\n";
+        }
+        return 0;
+    }
+
+    if (many_lights)
+    {
+        // Point lights with a radius scattered through the space around the model (view space)
+        std::mt19937 rng(2019);
+        std::uniform_real_distribution<float> unit(0, 1);
+        light_block scene;
+        scene.ambient = {4, 4, 4};
+        for (int i = 0; i < many_lights; i++)
+        {
+            light l;
+            l.position = Eigen::Vector3f(-4.5f + 9 * unit(rng), -4.5f + 9 * unit(rng), -12 + 7 * unit(rng));
+            l.intensity = Eigen::Vector3f(unit(rng), unit(rng), unit(rng)) * 1.5f;
+            l.radius = 1 + 1.5f * unit(rng);
+            scene.lights.push_back(l);
+        }
+        r.set_lights(scene);
+        r.set_model(get_model_matrix(angle));
+        r.set_view(get_view_matrix(eye_pos));
+        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+
+        // Every light for every fragment, then the per tile light lists
+        const int frames = 10;
+        std::vector<Eigen::Vector3f> images[2];
+        for (int culling = 0; culling < 2; culling++)
+        {
+            r.set_light_culling(culling);
+            r.reset_stats();
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < frames; i++)
+            {
+                r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+                r.draw(mesh);
+            }
+            auto stop = std::chrono::steady_clock::now();
+            auto stats = r.stats();
+            images[culling] = r.frame_buffer();
+            std::cout << (culling ? "tiled light culling" : "all lights") << ":\n";
+            std::cout << "  ms/frame:         " << std::chrono::duration<double>(stop - start).count() * 1000 / frames << "\n";
+            std::cout << "  lights/fragment:  " << (stats.shaded ? (double)stats.lights / stats.shaded : 0) << "\n";
+        }
+
+        int differing = 0;
+        for (size_t i = 0; i < images[0].size(); i++)
+        {
+            differing += images[0][i] != images[1][i];
+        }
+        std::cout << "pixels that differ: " << differing << "\n";
 
         cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
         image.convertTo(image, CV_8UC3, 1.0f);
         cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
-
         cv::imwrite(filename, image);
+        return 0;
+    }
+
+    // Shaded straight into an 8 bit BGRA image that imshow takes as is; written files drop the alpha
+    r.set_pixel_format(rst::PixelFormat::BGRA8);
+
+    if (sequence_frames)
+    {
+        r.set_view(get_view_matrix(eye_pos));
+        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+
+        // Frame i renders while the writer encodes the ones before it
+        ImageWriter writer(2);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < sequence_frames; i++)
+        {
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            r.set_model(get_model_matrix(angle + 360.0f * i / sequence_frames));
+            r.draw(mesh);
+            // Alpha is dropped straight into the writer's buffer, no extra copy per frame
+            cv::Mat buffer = writer.acquire(700, 700, CV_8UC3);
+            cv::cvtColor(r.frame_view(), buffer, cv::COLOR_BGRA2BGR);
+            writer.submit(ImageWriter::sequenceName(filename, i), buffer);
+        }
+        writer.wait();
+        auto stop = std::chrono::steady_clock::now();
+        std::cout << "ms/frame: " << std::chrono::duration<double>(stop - start).count() * 1000 / sequence_frames << "\n";
+        return writer.failures() ? 1 : 0;
+    }
+
+    if (command_line)
+    {
+        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+        r.set_model(get_model_matrix(angle));
+        r.set_view(get_view_matrix(eye_pos));
+        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+
+        r.draw(mesh);
+
+        cv::Mat bgr;
+        cv::cvtColor(r.frame_view(), bgr, cv::COLOR_BGRA2BGR);
+        cv::imwrite(filename, bgr);
 
         return 0;
     }
 
+    // Encodes the previous frame while the next one renders
+    ImageWriter writer;
     while(key != 27)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
@@ -457,13 +989,13 @@ int main(int argc, const char** argv)
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        r.draw(mesh);
+        cv::Mat image = r.frame_view();
 
         cv::imshow("image", image);
-        cv::imwrite(filename, image);
+        cv::Mat buffer = writer.acquire(700, 700, CV_8UC3);
+        cv::cvtColor(image, buffer, cv::COLOR_BGRA2BGR);
+        writer.submit(filename, buffer);
         key = cv::waitKey(10);
 
         if (key == 'a' )
@@ -3,9 +3,19 @@
 //
 
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define RST_AVX2_KERNEL 1
+#endif
+
 using namespace Eigen;
 
 rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
@@ -42,6 +52,22 @@ rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>
     return {id};
 }
 
+rst::tex_buf_id rst::rasterizer::load_tex_coords(const std::vector<Eigen::Vector2f>& tex_coords)
+{
+    auto id = get_next_id();
+    tex_buf.emplace(id, tex_coords);
+
+    return {id};
+}
+
+rst::tan_buf_id rst::rasterizer::load_tangents(const std::vector<Eigen::Vector4f>& tangents)
+{
+    auto id = get_next_id();
+    tan_buf.emplace(id, tangents);
+
+    return {id};
+}
+
 
 // Bresenham's line drawing algorithm
 void rst::rasterizer::draw_line(Eigen::Vector4f begin, Eigen::Vector4f end)
@@ -149,237 +175,1813 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static bool insideTriangle(int x, int y, const Vector4f* _v){
-    Vector3f v[3];
-    for(int i=0;i<3;i++)
-        v[i] = {_v[i].x(),_v[i].y(), 1.0};
-    Vector3f f0,f1,f2;
-    f0 = v[1].cross(v[0]);
-    f1 = v[2].cross(v[1]);
-    f2 = v[0].cross(v[2]);
-    Vector3f p(x,y,1.);
-    if((p.dot(f0)*f0.dot(v[2])>0) && (p.dot(f1)*f1.dot(v[0])>0) && (p.dot(f2)*f2.dot(v[1])>0))
-        return true;
-    return false;
+// Triangle setup: E_i(x, y) = A[i] * x + B[i] * y + C[i] is the edge function of the edge opposite
+// vertex i, scaled so that pixels inside the triangle have all three E_i > 0 and E_i * inv_area is
+// the barycentric coordinate of vertex i. a_step/b_step hold the offsets A[i] * k and B[i] * k inside
+// a BLOCK_SIZE block; edge values are evaluated once at each block corner and stepped from there,
+// so every pixel gets the same value no matter which tile or thread rasterizes it.
+struct triangle_setup
+{
+    float A[3], B[3], C[3];
+    float inv_area;
+    float a_step[3][rst::BLOCK_SIZE];
+    float b_step[3][rst::BLOCK_SIZE];
+    float inv_w[3];
+    float z_over_w[3];
+};
+
+static bool setup_triangle(const std::array<Vector4f, 3>& v, triangle_setup& s)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        const auto& p = v[(i + 1) % 3];
+        const auto& q = v[(i + 2) % 3];
+        s.A[i] = p.y() - q.y();
+        s.B[i] = q.x() - p.x();
+        s.C[i] = p.x() * q.y() - q.x() * p.y();
+    }
+
+    float area = s.A[0] * v[0].x() + s.B[0] * v[0].y() + s.C[0];
+    if (area == 0 || !std::isfinite(area))
+        return false;
+
+    // Clockwise triangles: flip the edges so that "inside" is always E_i > 0
+    if (area < 0)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            s.A[i] = -s.A[i];
+            s.B[i] = -s.B[i];
+            s.C[i] = -s.C[i];
+        }
+        area = -area;
+    }
+    s.inv_area = 1.0f / area;
+
+    for (int i = 0; i < 3; i++)
+    {
+        for (int k = 0; k < rst::BLOCK_SIZE; k++)
+        {
+            s.a_step[i][k] = s.A[i] * k;
+            s.b_step[i][k] = s.B[i] * k;
+        }
+        s.inv_w[i] = 1.0f / v[i].w();
+        s.z_over_w[i] = v[i].z() * s.inv_w[i];
+    }
+    return true;
+}
+
+// Plane equation of one attribute component divided by w: f(x, y) = dx * (x - x0) + dy * (y - y0) + c,
+// i.e. sum_i E_i(x, y) * inv_area * a_i / w_i, anchored at the top left (x0, y0) of the triangle's
+// bounding box to keep the magnitudes of c and the offsets small. The attribute at a pixel is
+// f(x, y) times the w interpolated there (1 / inv_w plane), which makes it perspective correct.
+struct attribute_plane
+{
+    float dx, dy, c;
+
+    float at(int x, int y) const { return dx * x + dy * y + c; }
+};
+
+// Planes of the varyings a fragment shader reads, see Varyings; x and y passed to at() are
+// relative to (x0, y0)
+struct varying_planes
+{
+    Varyings used;
+    int x0, y0;
+    attribute_plane inv_w;
+    attribute_plane color[3];
+    attribute_plane normal[3];
+    attribute_plane tex_coords[2];
+    attribute_plane view_pos[3];
+    attribute_plane tangent[4];
+};
+
+static attribute_plane setup_plane(const triangle_setup& s, int x0, int y0, float a0, float a1, float a2)
+{
+    float a[3] = {a0, a1, a2};
+    attribute_plane plane = {0, 0, 0};
+    for (int i = 0; i < 3; i++)
+    {
+        float p = a[i] * s.inv_w[i] * s.inv_area;
+        plane.dx += p * s.A[i];
+        plane.dy += p * s.B[i];
+        plane.c += p * (s.A[i] * x0 + s.B[i] * y0 + s.C[i]);
+    }
+    return plane;
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f* v){
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+template <typename Attributes>
+static void setup_planes(const triangle_setup& s, int x0, int y0, const Attributes& attr, attribute_plane* planes)
+{
+    for (int c = 0; c < attr[0].size(); c++)
+    {
+        planes[c] = setup_plane(s, x0, y0, attr[0][c], attr[1][c], attr[2][c]);
+    }
 }
 
-void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+template <int N>
+static Eigen::Matrix<float, N, 1> interpolate_planes(const attribute_plane (&planes)[N], int x, int y, float w)
+{
+    Eigen::Matrix<float, N, 1> value;
+    for (int c = 0; c < N; c++)
+    {
+        value[c] = planes[c].at(x, y) * w;
+    }
+    return value;
+}
 
-    float f1 = (50 - 0.1) / 2.0;
-    float f2 = (50 + 0.1) / 2.0;
+// Attribute setup of a screen space triangle for the varyings used. Anchored at the unclipped
+// bounding box, so every tile (and the visibility buffer pass) interpolates the same values.
+static void setup_varyings(const Triangle& t, const std::array<Vector3f, 3>& view_pos, const triangle_setup& s, Varyings used, varying_planes& planes)
+{
+    int ax = (int)std::floor(std::min({t.v[0].x(), t.v[1].x(), t.v[2].x()}));
+    int ay = (int)std::floor(std::min({t.v[0].y(), t.v[1].y(), t.v[2].y()}));
+    planes.used = used;
+    planes.x0 = ax;
+    planes.y0 = ay;
+    planes.inv_w = setup_plane(s, ax, ay, 1, 1, 1);
+    if (uses(used, Varyings::Color))
+        setup_planes(s, ax, ay, t.color, planes.color);
+    if (uses(used, Varyings::Normal))
+        setup_planes(s, ax, ay, t.normal, planes.normal);
+    if (uses(used, Varyings::TexCoords | Varyings::TexDerivatives))
+        setup_planes(s, ax, ay, t.tex_coords, planes.tex_coords);
+    if (uses(used, Varyings::ViewPos))
+        setup_planes(s, ax, ay, view_pos, planes.view_pos);
+    if (uses(used, Varyings::Tangent))
+        setup_planes(s, ax, ay, t.tangent, planes.tangent);
+}
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto& t:TriangleList)
+// Interpolates the used varyings at pixel (x, y) into payload
+static void interpolate_varyings(const varying_planes& planes, int x, int y, fragment_shader_payload& payload)
+{
+    const Varyings used = planes.used;
+    int px = x - planes.x0, py = y - planes.y0;
+    float w = 1.0f / planes.inv_w.at(px, py);
+
+    if (uses(used, Varyings::Color))
+        payload.color = interpolate_planes(planes.color, px, py, w);
+    if (uses(used, Varyings::Normal))
+        payload.normal = interpolate_planes(planes.normal, px, py, w).normalized();
+    if (uses(used, Varyings::TexCoords))
+        payload.tex_coords = interpolate_planes(planes.tex_coords, px, py, w);
+    if (uses(used, Varyings::ViewPos))
+        payload.view_pos = interpolate_planes(planes.view_pos, px, py, w);
+
+    // Interpolated like the normal; the sign is the same at all vertices of a triangle
+    // unless it straddles a mirrored UV seam, then take the side the pixel is on
+    if (uses(used, Varyings::Tangent))
     {
-        Triangle newtri = *t;
+        Eigen::Vector4f interpolated_tangent = interpolate_planes(planes.tangent, px, py, w);
+        payload.tangent << interpolated_tangent.head<3>(), interpolated_tangent.w() < 0 ? -1.0f : 1.0f;
+    }
 
-        std::array<Eigen::Vector4f, 3> mm {
-                (view * model * t->v[0]),
-                (view * model * t->v[1]),
-                (view * model * t->v[2])
+    // UV derivatives from the 2x2 quad the pixel belongs to: the texture coordinates
+    // are evaluated at the quad's top left, right and bottom pixels whether those
+    // are covered or not (helper pixels), then differenced
+    if (uses(used, Varyings::TexDerivatives))
+    {
+        int qx = (x & ~1) - planes.x0;
+        int qy = (y & ~1) - planes.y0;
+        auto quad_texcoords = [&](int dx, int dy) {
+            float qw = 1.0f / planes.inv_w.at(qx + dx, qy + dy);
+            return Eigen::Vector2f(interpolate_planes(planes.tex_coords, qx + dx, qy + dy, qw));
         };
+        Eigen::Vector2f uv00 = quad_texcoords(0, 0);
+        payload.tex_coords_dx = quad_texcoords(1, 0) - uv00;
+        payload.tex_coords_dy = quad_texcoords(0, 1) - uv00;
+    }
+}
 
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
+// Depth of the pixels a span kernel let through
+struct span_fragments
+{
+    float z[rst::BLOCK_SIZE];
+};
 
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-            return v.template head<3>();
-        });
+// A span kernel handles one block row: pixel bx + k is considered when bit k of lanes is set.
+// It runs the coverage test on the edge values, interpolates depth, tests it against depth[k]
+// and writes it back for the pixels that pass. Returns the passing pixels as a bit mask and
+// adds the number of covered pixels to covered. The Equal kernels pass pixels whose depth equals
+// depth[k] and write nothing, for the shading pass after a depth prepass. The Inside kernels skip
+// the coverage test, for blocks classify_block found entirely inside the triangle.
+typedef unsigned (*span_kernel)(const triangle_setup& s, const float e_row[3], unsigned lanes, float* depth, span_fragments& out, uint64_t& covered);
 
-        Eigen::Vector4f v[] = {
-                mvp * t->v[0],
-                mvp * t->v[1],
-                mvp * t->v[2]
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec.x()/=vec.w();
-            vec.y()/=vec.w();
-            vec.z()/=vec.w();
-        }
-
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-                inv_trans * to_vec4(t->normal[0], 0.0f),
-                inv_trans * to_vec4(t->normal[1], 0.0f),
-                inv_trans * to_vec4(t->normal[2], 0.0f)
-        };
+template <bool Equal, bool Inside>
+static unsigned depth_test_span_scalar(const triangle_setup& s, const float e_row[3], unsigned lanes, float* depth, span_fragments& out, uint64_t& covered)
+{
+    unsigned passed = 0;
+    for (int k = 0; k < rst::BLOCK_SIZE; k++)
+    {
+        if (!(lanes & (1u << k)))
+            continue;
 
-        //Viewport transformation
-        for (auto & vert : v)
-        {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
-        }
+        float e0 = e_row[0] + s.a_step[0][k];
+        float e1 = e_row[1] + s.a_step[1][k];
+        float e2 = e_row[2] + s.a_step[2][k];
+        if (!Inside && (e0 <= 0 || e1 <= 0 || e2 <= 0))
+            continue;
 
-        for (int i = 0; i < 3; ++i)
-        {
-            //screen space coordinates
-            newtri.setVertex(i, v[i]);
-        }
+        covered++;
+        float alpha = e0 * s.inv_area;
+        float beta = e1 * s.inv_area;
+        float gamma = e2 * s.inv_area;
+        float w_reciprocal = 1.0f / (alpha * s.inv_w[0] + beta * s.inv_w[1] + gamma * s.inv_w[2]);
+        float z_interpolated = alpha * s.z_over_w[0] + beta * s.z_over_w[1] + gamma * s.z_over_w[2];
+        z_interpolated *= w_reciprocal;
 
-        for (int i = 0; i < 3; ++i)
+        if (Equal ? z_interpolated == depth[k] : z_interpolated > depth[k])
         {
-            //view space normal
-            newtri.setNormal(i, n[i].head<3>());
+            if (!Equal)
+                depth[k] = z_interpolated;
+            out.z[k] = z_interpolated;
+            passed |= 1u << k;
         }
-
-        newtri.setColor(0, 148,121.0,92.0);
-        newtri.setColor(1, 148,121.0,92.0);
-        newtri.setColor(2, 148,121.0,92.0);
-
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
-        // rasterize_wireframe(newtri);
     }
+    return passed;
 }
 
-static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
-{
-    return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
-}
+#ifdef RST_AVX2_KERNEL
+static_assert(rst::BLOCK_SIZE == 8, "the AVX2 span kernel handles 8 pixels at once");
 
-static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
+// Same arithmetic as depth_test_span_scalar, 8 pixels at a time. Only avx2 is enabled (no fma)
+// so that every operation rounds exactly like the scalar code and both kernels agree bit for bit.
+template <bool Equal, bool Inside>
+__attribute__((target("avx2")))
+static unsigned depth_test_span_avx2(const triangle_setup& s, const float e_row[3], unsigned lanes, float* depth, span_fragments& out, uint64_t& covered)
 {
-    auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
-    auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i active = _mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32((int)lanes), lane_bits), _mm256_setzero_si256());
 
-    u /= weight;
-    v /= weight;
+    __m256 e0 = _mm256_add_ps(_mm256_set1_ps(e_row[0]), _mm256_loadu_ps(s.a_step[0]));
+    __m256 e1 = _mm256_add_ps(_mm256_set1_ps(e_row[1]), _mm256_loadu_ps(s.a_step[1]));
+    __m256 e2 = _mm256_add_ps(_mm256_set1_ps(e_row[2]), _mm256_loadu_ps(s.a_step[2]));
 
-    return Eigen::Vector2f(u, v);
+    __m256 inside = _mm256_castsi256_ps(active);
+    if (!Inside)
+    {
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(e0, zero, _CMP_GT_OQ));
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(e1, zero, _CMP_GT_OQ));
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(e2, zero, _CMP_GT_OQ));
+    }
+    int inside_mask = _mm256_movemask_ps(inside);
+    if (!inside_mask)
+        return 0;
+    covered += __builtin_popcount(inside_mask);
+
+    __m256 inv_area = _mm256_set1_ps(s.inv_area);
+    __m256 alpha = _mm256_mul_ps(e0, inv_area);
+    __m256 beta = _mm256_mul_ps(e1, inv_area);
+    __m256 gamma = _mm256_mul_ps(e2, inv_area);
+
+    __m256 w_sum = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(alpha, _mm256_set1_ps(s.inv_w[0])),
+                                               _mm256_mul_ps(beta, _mm256_set1_ps(s.inv_w[1]))),
+                                 _mm256_mul_ps(gamma, _mm256_set1_ps(s.inv_w[2])));
+    __m256 w_reciprocal = _mm256_div_ps(_mm256_set1_ps(1.0f), w_sum);
+    __m256 z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(alpha, _mm256_set1_ps(s.z_over_w[0])),
+                                           _mm256_mul_ps(beta, _mm256_set1_ps(s.z_over_w[1]))),
+                             _mm256_mul_ps(gamma, _mm256_set1_ps(s.z_over_w[2])));
+    z = _mm256_mul_ps(z, w_reciprocal);
+
+    // Masked load/store: lanes past the right edge of the screen are never touched
+    __m256i inside_i = _mm256_castps_si256(inside);
+    __m256 d = _mm256_maskload_ps(depth, inside_i);
+    __m256 pass = _mm256_and_ps(_mm256_cmp_ps(z, d, Equal ? _CMP_EQ_OQ : _CMP_GT_OQ), inside);
+    if (!Equal)
+        _mm256_maskstore_ps(depth, _mm256_castps_si256(pass), z);
+
+    _mm256_storeu_ps(out.z, z);
+    return (unsigned)_mm256_movemask_ps(pass);
 }
+#endif
 
-void rst::rasterizer::rasterize_wireframe(const Triangle& t)
+static span_kernel select_span_kernel(bool simd, bool equal, bool inside)
 {
-    draw_line(t.c(), t.a());
-    draw_line(t.c(), t.b());
-    draw_line(t.b(), t.a());
+#ifdef RST_AVX2_KERNEL
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (simd && has_avx2)
+    {
+        if (inside)
+            return equal ? depth_test_span_avx2<true, true> : depth_test_span_avx2<false, true>;
+        return equal ? depth_test_span_avx2<true, false> : depth_test_span_avx2<false, false>;
+    }
+#endif
+    if (inside)
+        return equal ? depth_test_span_scalar<true, true> : depth_test_span_scalar<false, true>;
+    return equal ? depth_test_span_scalar<true, false> : depth_test_span_scalar<false, false>;
 }
 
-//Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos) 
+enum class BlockCoverage
 {
-        auto v = t.toVector4();
-    
-    float l = 99999999;
-    float r = -9999999;
-    float top = 99999999;
-    float d = -9999999;
-    for (size_t i = 0; i < v.size(); i++)
+    Outside,
+    Partial,
+    Inside
+};
+
+// Classifies the pixels [xs, xe] x [ys, ye] of the block at (bx, by) from the edge values at the
+// corners of that range. The kernels compute a pixel's edge value as
+// (e_block + b_step[dy]) + a_step[dx], and each of those roundings is monotonic in dx and dy, so the
+// corner values computed the same way are exactly the extremes over the range: the result agrees
+// with the per pixel test bit for bit.
+static BlockCoverage classify_block(const triangle_setup& s, const float e_block[3], int dx0, int dx1, int dy0, int dy1)
+{
+    bool inside = true;
+    for (int i = 0; i < 3; i++)
     {
-        l = v[i].x() < l ? v[i].x() : l;
-        r = v[i].x() > r ? v[i].x() : r;
-        top = v[i].y() < top ? v[i].y() : top;
-        d = v[i].y() > d ? v[i].y() : d;  
+        float top = e_block[i] + s.b_step[i][dy0];
+        float bottom = e_block[i] + s.b_step[i][dy1];
+        float c0 = top + s.a_step[i][dx0], c1 = top + s.a_step[i][dx1];
+        float c2 = bottom + s.a_step[i][dx0], c3 = bottom + s.a_step[i][dx1];
+        if (std::max({c0, c1, c2, c3}) <= 0)
+            return BlockCoverage::Outside;
+        inside = inside && std::min({c0, c1, c2, c3}) > 0;
     }
-    
-    for (size_t y = top; y <= d; y++)
+    return inside ? BlockCoverage::Inside : BlockCoverage::Partial;
+}
+
+// Clip planes as signed distances in clip space, >= 0 is inside. The projection of this assignment
+// puts w = z_view (negative in front of the camera) and maps the near plane to z/w = 1, so the near
+// plane is z - w >= 0 and x/w <= g becomes x - g * w >= 0. Near clipping comes first: once w < 0 is
+// guaranteed the other planes are the usual [-g, g] range in NDC.
+enum clip_plane { CLIP_NEAR, CLIP_RIGHT, CLIP_LEFT, CLIP_TOP, CLIP_BOTTOM, CLIP_PLANE_COUNT };
+
+static float clip_distance(const Vector4f& p, int plane, float g)
+{
+    switch (plane)
     {
-        for (size_t x = l; x <= r; x++)
-        {
-            if (insideTriangle(x, y, t.v))
-            {
-                auto[alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-                float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                z_interpolated *= w_reciprocal;
+        case CLIP_NEAR:   return p.z() - p.w();
+        case CLIP_RIGHT:  return p.x() - g * p.w();
+        case CLIP_LEFT:   return -p.x() - g * p.w();
+        case CLIP_TOP:    return p.y() - g * p.w();
+        default:          return -p.y() - g * p.w();
+    }
+}
 
-                if (depth_buf[y*width+x] == std::numeric_limits<float>::infinity() || z_interpolated > depth_buf[y*width+x])
-                {
-                    auto interpolated_color = alpha * t.color[0] / v[0].w() + beta * t.color[1] / v[1].w() + gamma * t.color[2] / v[2].w();
-                    auto interpolated_normal = alpha * t.normal[0] / v[0].w() + beta * t.normal[1] / v[1].w() + gamma * t.normal[2] / v[2].w();
-                    auto interpolated_texcoords = alpha * t.tex_coords[0] / v[0].w() + beta * t.tex_coords[1] / v[1].w() + gamma * t.tex_coords[2] / v[2].w();
-                    auto interpolated_shadingcoords = alpha * view_pos[0] / v[0].w() + beta * view_pos[1] / v[1].w() + gamma * view_pos[2] / v[2].w();
+static rst::clip_vertex lerp(const rst::clip_vertex& a, const rst::clip_vertex& b, float t)
+{
+    return {a.pos + t * (b.pos - a.pos),
+            a.view_pos + t * (b.view_pos - a.view_pos),
+            a.normal + t * (b.normal - a.normal),
+            a.tex_coords + t * (b.tex_coords - a.tex_coords),
+            a.tangent + t * (b.tangent - a.tangent)};
+}
 
-                    fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-                    payload.view_pos = interpolated_shadingcoords;
+// Each plane adds at most one vertex to the polygon
+static constexpr int MAX_CLIP_VERTICES = 3 + CLIP_PLANE_COUNT;
 
-                    auto pixel_color = fragment_shader(payload);
+// Sutherland-Hodgman against the planes in plane_mask, returns the vertex count of the clipped
+// convex polygon in out (0 if nothing is left)
+static int clip_polygon(const rst::clip_vertex in[3], unsigned plane_mask, rst::clip_vertex out[MAX_CLIP_VERTICES])
+{
+    rst::clip_vertex buf[MAX_CLIP_VERTICES];
+    std::copy(in, in + 3, out);
+    int count = 3;
 
-                    depth_buf[y*width+x] = z_interpolated;
-                    set_pixel(Eigen::Vector2i(x, y), pixel_color);
-                }
-            }            
-        }
-    }
+    for (int plane = 0; plane < CLIP_PLANE_COUNT && count > 0; ++plane)
+    {
+        if (!(plane_mask & (1u << plane)))
+            continue;
 
-    // TODO: From your HW3, get the triangle rasterization code.
-    // TODO: Inside your rasterization loop:
-    //    * v[i].w() is the vertex view space depth value z.
-    //    * Z is interpolated view space depth for the current pixel
-    //    * zp is depth between zNear and zFar, used for z-buffer
+        std::copy(out, out + count, buf);
+        int n = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            const rst::clip_vertex& a = buf[i];
+            const rst::clip_vertex& b = buf[(i + 1) % count];
+            float da = clip_distance(a.pos, plane, rst::GUARD_BAND);
+            float db = clip_distance(b.pos, plane, rst::GUARD_BAND);
 
-    // float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-    // float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-    // zp *= Z;
+            if (da >= 0)
+                out[n++] = a;
+            if ((da >= 0) != (db >= 0))
+                out[n++] = lerp(a, b, da / (da - db));
+        }
+        count = n;
+    }
+    return count;
+}
 
-    // TODO: Interpolate the attributes:
-    // auto interpolated_color
-    // auto interpolated_normal
-    // auto interpolated_texcoords
-    // auto interpolated_shadingcoords
+// Vertex stage: runs the vertex shader and takes the vertex to clip space. The matrices are the
+// per draw uniforms, computed once by the caller.
+rst::clip_vertex rst::rasterizer::process_vertex(const Eigen::Vector4f& pos, const Eigen::Vector3f& normal, const Eigen::Vector2f& tex_coords, const Eigen::Vector4f& tangent,
+                                                 const Eigen::Matrix4f& mvp, const Eigen::Matrix4f& model_view, const Eigen::Matrix4f& inv_trans)
+{
+    vertex_count++;
 
-    // Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-    // Use: payload.view_pos = interpolated_shadingcoords;
-    // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
-    // Use: auto pixel_color = fragment_shader(payload);
+    Eigen::Vector4f v = pos;
+    if (vertex_shader)
+    {
+        v = to_vec4(vertex_shader({pos.head<3>()}), pos.w());
+    }
 
- 
+    clip_vertex cv;
+    cv.pos = mvp * v;
+    cv.view_pos = (model_view * v).head<3>();
+    cv.normal = (inv_trans * to_vec4(normal, 0.0f)).head<3>();
+    cv.tex_coords = tex_coords;
+    // Tangents lie in the surface, they go through model_view like positions (w = 0)
+    cv.tangent << (model_view * to_vec4(tangent.head<3>(), 0.0f)).head<3>(), tangent.w();
+    return cv;
 }
 
-void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
+// Viewport transform of the NDC depth
+static const float DEPTH_SCALE = (50 - 0.1) / 2.0;
+static const float DEPTH_OFFSET = (50 + 0.1) / 2.0;
+
+void rst::rasterizer::set_lights(const light_block& block)
 {
-    model = m;
+    uniforms.lighting = block;
+    light_indices.resize(block.lights.size());
+    for (int i = 0; i < (int)light_indices.size(); i++)
+    {
+        light_indices[i] = i;
+    }
 }
 
-void rst::rasterizer::set_view(const Eigen::Matrix4f& v)
+// Screen rectangle and depth range of every light's bounding sphere (light positions are in view
+// space, like view_pos), for cull_lights. Lights without a radius cover everything.
+void rst::rasterizer::compute_light_extents()
 {
-    view = v;
+    const float inf = std::numeric_limits<float>::infinity();
+    const auto& lights = uniforms.lighting.lights;
+    light_extents.resize(lights.size());
+    for (size_t i = 0; i < lights.size(); i++)
+    {
+        const light& l = lights[i];
+        light_extent& e = light_extents[i];
+        e = {-inf, -inf, inf, inf, -inf, inf};
+        if (l.radius <= 0)
+            continue;
+
+        // The projection maps view z to depth independently of x and y, so the depth range comes from
+        // the sphere's nearest and farthest points along z
+        Vector4f front = projection * Vector4f(0, 0, l.position.z() + l.radius, 1);
+        Vector4f back = projection * Vector4f(0, 0, l.position.z() - l.radius, 1);
+        if (clip_distance(back, CLIP_NEAR, 1) < 0)
+        {
+            // Entirely behind the near plane
+            e = {inf, inf, -inf, -inf, inf, -inf};
+            continue;
+        }
+        float z_back = back.z() / back.w() * DEPTH_SCALE + DEPTH_OFFSET;
+        if (clip_distance(front, CLIP_NEAR, 1) < 0)
+        {
+            // Crosses the near plane: anywhere on screen, from z_back to the camera
+            e.z_far = z_back;
+            continue;
+        }
+        float z_front = front.z() / front.w() * DEPTH_SCALE + DEPTH_OFFSET;
+
+        // All of the sphere's bounding box is in front of the camera, its projection bounds the sphere's
+        e = {inf, inf, -inf, -inf, std::min(z_front, z_back), std::max(z_front, z_back)};
+        for (int corner = 0; corner < 8; corner++)
+        {
+            Vector3f offset((corner & 1) ? l.radius : -l.radius, (corner & 2) ? l.radius : -l.radius, (corner & 4) ? l.radius : -l.radius);
+            Vector4f clip = projection * to_vec4(l.position + offset);
+            float x = 0.5f * width * (clip.x() / clip.w() + 1.0f);
+            float y = 0.5f * height * (clip.y() / clip.w() + 1.0f);
+            e.x0 = std::min(e.x0, x);
+            e.x1 = std::max(e.x1, x);
+            e.y0 = std::min(e.y0, y);
+            e.y1 = std::max(e.y1, y);
+        }
+
+        // Margins for the rounding of the fragments' interpolated positions
+        e.x0 -= 1;
+        e.y0 -= 1;
+        e.x1 += 1;
+        e.y1 += 1;
+        e.z_far -= 1e-4f * (1 + std::fabs(e.z_far));
+        e.z_near += 1e-4f * (1 + std::fabs(e.z_near));
+    }
 }
 
-void rst::rasterizer::set_projection(const Eigen::Matrix4f& p)
+// Lights whose extent overlaps the pixels of rect and the depth range [z_far, z_near]
+void rst::rasterizer::cull_lights(const screen_rect& rect, float z_far, float z_near, std::vector<int>& out) const
 {
-    projection = p;
+    out.clear();
+    for (int i = 0; i < (int)light_extents.size(); i++)
+    {
+        const light_extent& e = light_extents[i];
+        if (e.x1 < rect.x0 || e.x0 > rect.x1 - 1 || e.y1 < rect.y0 || e.y0 > rect.y1 - 1)
+            continue;
+        if (e.z_near < z_far || e.z_far > z_near)
+            continue;
+        out.push_back(i);
+    }
 }
 
-void rst::rasterizer::clear(rst::Buffers buff)
+void rst::rasterizer::begin_draw()
 {
-    if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
+    if (visibility_buffer)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        // Triangle ids are per draw: every tile starts over, filled when first rasterized into
+        vis_buf.resize(width * height);
+        for (auto& state : vis_tiles)
+        {
+            if (state == TileState::Written)
+                state = TileState::Cleared;
+        }
     }
-    if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
+    else if (deferred)
+    {
+        gbuffer.resize(width * height);
+    }
+    if (light_culling)
     {
-        std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        compute_light_extents();
+        tile_lights.resize(tiles_x * tiles_y);
     }
+    serial_queue.lights = all_lights();
+    binned_tris.clear();
+    binned_view_pos.clear();
 }
 
-rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
+// Fills sort_order with the indices of binned_tris ordered by the depth of their centroid, closest
+// first; the triangles themselves stay where they are. The key is the top 16 bits of the depth's
+// float representation (made to sort as unsigned integers), which is plenty to order triangles
+// coarsely; two stable 8 bit counting passes sort it.
+void rst::rasterizer::sort_front_to_back()
 {
-    frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
+    int n = (int)binned_tris.size();
+    sort_keys.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        const auto& v = binned_tris[i].v;
+        float z = (v[0].z() + v[1].z() + v[2].z()) / 3;
+        uint32_t bits;
+        std::memcpy(&bits, &z, sizeof(bits));
+        // Monotonic float -> uint mapping, inverted so that larger (closer) depths come first
+        bits ^= (bits & 0x80000000u) ? 0xffffffffu : 0x80000000u;
+        sort_keys[i] = ~bits >> 16;
+    }
 
-    texture = std::nullopt;
+    sort_order.resize(n);
+    sort_scratch.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        sort_order[i] = i;
+    }
+    for (int shift = 0; shift < 16; shift += 8)
+    {
+        int offsets[257] = {};
+        for (int i = 0; i < n; i++)
+        {
+            offsets[((sort_keys[i] >> shift) & 0xff) + 1]++;
+        }
+        for (int b = 0; b < 256; b++)
+        {
+            offsets[b + 1] += offsets[b];
+        }
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t index = sort_order[i];
+            sort_scratch[offsets[(sort_keys[index] >> shift) & 0xff]++] = index;
+        }
+        std::swap(sort_order, sort_scratch);
+    }
 }
 
-int rst::rasterizer::get_index(int x, int y)
+void rst::rasterizer::end_draw()
 {
-    return (height-y)*width + x;
+    const uint32_t* order = nullptr;
+    if (front_to_back)
+    {
+        sort_front_to_back();
+        order = sort_order.data();
+    }
+    if (binning())
+    {
+        if (visibility_buffer)
+        {
+            rasterize_tiles(binned_tris, binned_view_pos, order, RasterPass::Visibility);
+        }
+        else if (depth_prepass)
+        {
+            rasterize_tiles(binned_tris, binned_view_pos, order, RasterPass::DepthOnly);
+            rasterize_tiles(binned_tris, binned_view_pos, order, RasterPass::DepthEqual);
+        }
+        else
+        {
+            rasterize_tiles(binned_tris, binned_view_pos, order, RasterPass::Shade);
+        }
+    }
+    flush_fragments(serial_queue);
+
+    if (visibility_buffer)
+    {
+        shade_visibility();
+    }
+    else if (deferred)
+    {
+        shade_gbuffer();
+    }
 }
 
-void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
+// Primitive assembly: trivial reject/accept, clipping, perspective divide and viewport transform,
+// then the triangle is rasterized right away or binned for rasterize_tiles
+void rst::rasterizer::assemble_triangle(const clip_vertex (&cv)[3])
 {
-    //old index: auto ind = point.y() + point.x() * width;
-    int ind = (height-point.y())*width + point.x();
-    frame_buf[ind] = color;
+    // Trivial reject when all vertices are outside the near plane or one side of the screen,
+    // trivial accept when none crosses the near plane or leaves the guard band
+    bool rejected = false;
+    unsigned clip_mask = 0;
+    for (int plane = 0; plane < CLIP_PLANE_COUNT && !rejected; ++plane)
+    {
+        int outside_screen = 0;
+        for (int i = 0; i < 3; ++i)
+        {
+            outside_screen += clip_distance(cv[i].pos, plane, 1.0f) < 0;
+            if (clip_distance(cv[i].pos, plane, GUARD_BAND) < 0)
+                clip_mask |= 1u << plane;
+        }
+        rejected = outside_screen == 3;
+    }
+    if (rejected)
+    {
+        culled_triangle_count++;
+        return;
+    }
+
+    float f1 = DEPTH_SCALE;
+    float f2 = DEPTH_OFFSET;
+    screen_rect viewport{0, 0, width, height};
+
+    // Perspective divide and viewport transform of one (possibly clipped) triangle
+    auto emit = [&](const clip_vertex& c0, const clip_vertex& c1, const clip_vertex& c2)
+    {
+        const clip_vertex* tri[] = {&c0, &c1, &c2};
+        Triangle newtri;
+        std::array<Eigen::Vector3f, 3> viewspace_pos;
+
+        for (int i = 0; i < 3; ++i)
+        {
+            Eigen::Vector4f vert = tri[i]->pos;
+            //Homogeneous division
+            vert.x()/=vert.w();
+            vert.y()/=vert.w();
+            vert.z()/=vert.w();
+
+            //Viewport transformation
+            vert.x() = 0.5*width*(vert.x()+1.0);
+            vert.y() = 0.5*height*(vert.y()+1.0);
+            vert.z() = vert.z() * f1 + f2;
+
+            //screen space coordinates
+            newtri.setVertex(i, vert);
+            //view space normal
+            newtri.setNormal(i, tri[i]->normal);
+            newtri.setTexCoord(i, tri[i]->tex_coords);
+            newtri.setTangent(i, tri[i]->tangent);
+            viewspace_pos[i] = tri[i]->view_pos;
+        }
+
+        newtri.setColor(0, 148,121.0,92.0);
+        newtri.setColor(1, 148,121.0,92.0);
+        newtri.setColor(2, 148,121.0,92.0);
+
+        // Also pass view space vertice position
+        if (binning())
+        {
+            binned_tris.push_back(newtri);
+            binned_view_pos.push_back(viewspace_pos);
+        }
+        else
+        {
+            rasterize_triangle(newtri, viewspace_pos, viewport, serial_queue, RasterPass::Shade);
+        }
+        // rasterize_wireframe(newtri);
+    };
+
+    if (!clip_mask)
+    {
+        emit(cv[0], cv[1], cv[2]);
+        return;
+    }
+
+    clipped_triangle_count++;
+    clip_vertex poly[MAX_CLIP_VERTICES];
+    int count = clip_polygon(cv, clip_mask, poly);
+    for (int i = 1; i + 1 < count; ++i)
+    {
+        emit(poly[0], poly[i], poly[i + 1]);
+    }
+}
+
+void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+
+    Eigen::Matrix4f mvp = projection * view * model;
+    Eigen::Matrix4f model_view = view * model;
+    Eigen::Matrix4f inv_trans = model_view.inverse().transpose();
+
+    begin_draw();
+    for (const auto& t:TriangleList)
+    {
+        clip_vertex cv[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            cv[i] = process_vertex(t->v[i], t->normal[i], t->tex_coords[i], t->tangent[i], mvp, model_view, inv_trans);
+        }
+        assemble_triangle(cv);
+    }
+    end_draw();
+}
+
+// Buffer loaded under id with at least count elements, nullptr (reported) when there is none. Looked
+// up with find so a bad id is not default-inserted and drawn as an empty buffer.
+template <typename T>
+static const std::vector<T>* find_buffer(const std::map<int, std::vector<T>>& buffers, int id, size_t count, const char* name)
+{
+    auto it = buffers.find(id);
+    if (it == buffers.end())
+    {
+        fprintf(stderr, "ERROR! Unknown %s buffer %d, draw skipped\n", name, id);
+        return nullptr;
+    }
+    if (it->second.size() < count)
+    {
+        fprintf(stderr, "ERROR! %s buffer %d has %zu of %zu vertices, draw skipped\n", name, id, it->second.size(), count);
+        return nullptr;
+    }
+    return &it->second;
+}
+
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id normal_buffer, tex_buf_id tex_buffer)
+{
+    const auto* positions = find_buffer(pos_buf, pos_buffer.pos_id, 0, "position");
+    const auto* indices = find_buffer(ind_buf, ind_buffer.ind_id, 0, "index");
+    if (!positions || !indices)
+        return;
+    const auto* normals = find_buffer(nor_buf, normal_buffer.col_id, positions->size(), "normal");
+    const auto* tex_coords = find_buffer(tex_buf, tex_buffer.tex_id, positions->size(), "tex coord");
+    if (!normals || !tex_coords)
+        return;
+
+    draw_indexed(positions->data(), (int)positions->size(), indices->data(), (int)indices->size(),
+                 normals->data(), tex_coords->data(), nullptr);
+}
+
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id normal_buffer, tex_buf_id tex_buffer, tan_buf_id tangent_buffer)
+{
+    const auto* positions = find_buffer(pos_buf, pos_buffer.pos_id, 0, "position");
+    const auto* indices = find_buffer(ind_buf, ind_buffer.ind_id, 0, "index");
+    if (!positions || !indices)
+        return;
+    const auto* normals = find_buffer(nor_buf, normal_buffer.col_id, positions->size(), "normal");
+    const auto* tex_coords = find_buffer(tex_buf, tex_buffer.tex_id, positions->size(), "tex coord");
+    const auto* tangents = find_buffer(tan_buf, tangent_buffer.tan_id, positions->size(), "tangent");
+    if (!normals || !tex_coords || !tangents)
+        return;
+
+    draw_indexed(positions->data(), (int)positions->size(), indices->data(), (int)indices->size(),
+                 normals->data(), tex_coords->data(), tangents->data());
+}
+
+void rst::rasterizer::draw(const Mesh& mesh)
+{
+    draw_indexed(mesh.positions(), mesh.vertexCount(), mesh.indices(), mesh.triangleCount(),
+                 mesh.normals(), mesh.texCoords(), mesh.tangents());
+}
+
+void rst::rasterizer::draw_indexed(const Eigen::Vector3f* positions, int vertex_count, const Eigen::Vector3i* indices, int triangle_count,
+                                   const Eigen::Vector3f* normals, const Eigen::Vector2f* tex_coords, const Eigen::Vector4f* tangents)
+{
+    Eigen::Matrix4f mvp = projection * view * model;
+    Eigen::Matrix4f model_view = view * model;
+    Eigen::Matrix4f inv_trans = model_view.inverse().transpose();
+
+    // Post-transform cache: a vertex is shaded the first time an index refers to it and reused by
+    // every other triangle sharing it. The storage is kept across draws.
+    std::vector<clip_vertex>& transformed = vertex_cache;
+    std::vector<bool>& cached = vertex_cached;
+    transformed.resize(vertex_count);
+    cached.assign(vertex_count, false);
+
+    begin_draw();
+    for (int t = 0; t < triangle_count; t++)
+    {
+        const Eigen::Vector3i& ind = indices[t];
+        clip_vertex cv[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            int idx = ind[i];
+            if (!cached[idx])
+            {
+                Eigen::Vector4f tangent = tangents ? tangents[idx] : Eigen::Vector4f(0, 0, 0, 1);
+                transformed[idx] = process_vertex(to_vec4(positions[idx]), normals[idx], tex_coords[idx], tangent, mvp, model_view, inv_trans);
+                cached[idx] = true;
+            }
+            cv[i] = transformed[idx];
+        }
+        assemble_triangle(cv);
+    }
+    end_draw();
+}
+
+// Sorts the triangles into TILE_SIZE x TILE_SIZE screen tiles and rasterizes the tiles in parallel.
+// Every pixel belongs to exactly one tile and each tile keeps the submission order of its triangles,
+// so frame_buf/depth_buf need no locking and the result matches the serial path bit for bit.
+void rst::rasterizer::rasterize_tiles(const std::vector<Triangle>& tris, const std::vector<std::array<Eigen::Vector3f, 3>>& view_pos,
+                                      const uint32_t* order, RasterPass pass)
+{
+    // Bins keep their capacity from frame to frame
+    std::vector<std::vector<int>>& bins = tile_bins;
+    bins.resize(tiles_x * tiles_y);
+    for (auto& bin : bins)
+    {
+        bin.clear();
+    }
+    for (int k = 0; k < (int)tris.size(); k++)
+    {
+        int i = order ? (int)order[k] : k;
+        const auto& v = tris[i].v;
+        float l = std::min({v[0].x(), v[1].x(), v[2].x()});
+        float r = std::max({v[0].x(), v[1].x(), v[2].x()});
+        float top = std::min({v[0].y(), v[1].y(), v[2].y()});
+        float d = std::max({v[0].y(), v[1].y(), v[2].y()});
+
+        int x0 = (int)std::floor(std::clamp(l, 0.f, (float)width));
+        int x1 = (int)std::floor(std::clamp(r, -1.f, (float)width - 1));
+        int y0 = (int)std::floor(std::clamp(top, 0.f, (float)height));
+        int y1 = (int)std::floor(std::clamp(d, -1.f, (float)height - 1));
+        if (x0 > x1 || y0 > y1)
+            continue;
+
+        for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++)
+        {
+            for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++)
+            {
+                bins[ty * tiles_x + tx].push_back(i);
+            }
+        }
+    }
+
+    parallel_for_tiles([&](int tile, const screen_rect& rect) {
+        fragment_queue queue;
+        queue.lights = all_lights();
+        if (light_culling && !deferred && pass != RasterPass::DepthOnly && pass != RasterPass::Visibility && !bins[tile].empty())
+        {
+            // Whatever this draw writes into the tile lies between the closest vertex binned to it and
+            // the farthest depth the tile already holds (hi-z)
+            float z_far = std::numeric_limits<float>::infinity();
+            float z_near = -std::numeric_limits<float>::infinity();
+            for (int i : bins[tile])
+            {
+                for (const auto& v : tris[i].v)
+                {
+                    z_far = std::min(z_far, v.z());
+                    z_near = std::max(z_near, v.z());
+                }
+            }
+            z_far = std::max(z_far, hiz_tiles[tile]);
+            cull_lights(rect, z_far, z_near, tile_lights[tile]);
+            queue.lights = {tile_lights[tile].data(), tile_lights[tile].data() + tile_lights[tile].size()};
+        }
+        for (int i : bins[tile])
+        {
+            rasterize_triangle(tris[i], view_pos[i], rect, queue, pass, i);
+        }
+        flush_fragments(queue);
+    });
+}
+
+// Runs job once for every screen tile, spread over the worker pool and the calling thread
+void rst::rasterizer::run_tiles(tile_job job, const void* context)
+{
+    current_job = job;
+    current_context = context;
+    next_tile = 0;
+    if (workers.empty())
+    {
+        run_tile_job();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        busy_workers = (int)workers.size();
+        job_generation++;
+    }
+    pool_start.notify_all();
+    run_tile_job();
+
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    pool_done.wait(lock, [this]() { return busy_workers == 0; });
+}
+
+// Takes tiles of the current job until every tile has been handed out
+void rst::rasterizer::run_tile_job()
+{
+    int tile_count = tiles_x * tiles_y;
+    for (int tile = next_tile++; tile < tile_count; tile = next_tile++)
+    {
+        int tx = tile % tiles_x;
+        int ty = tile / tiles_x;
+        screen_rect rect{tx * TILE_SIZE, ty * TILE_SIZE,
+                         std::min((tx + 1) * TILE_SIZE, width), std::min((ty + 1) * TILE_SIZE, height)};
+        current_job(current_context, tile, rect);
+    }
+}
+
+// seen is the generation current when the worker was created, every later one is a job for it
+void rst::rasterizer::tile_worker(uint64_t seen)
+{
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    while (true)
+    {
+        pool_start.wait(lock, [&]() { return stopping || job_generation != seen; });
+        if (stopping)
+            return;
+        seen = job_generation;
+
+        lock.unlock();
+        run_tile_job();
+        lock.lock();
+
+        if (--busy_workers == 0)
+            pool_done.notify_one();
+    }
+}
+
+void rst::rasterizer::stop_workers()
+{
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        stopping = true;
+    }
+    pool_start.notify_all();
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    workers.clear();
+    stopping = false;
+}
+
+void rst::rasterizer::set_thread_count(int n)
+{
+    thread_count = std::max(1, n);
+    stop_workers();
+
+    // Taken here rather than by the worker once it runs: a job published before the worker gets to
+    // the lock counts it in busy_workers and has to be picked up
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        generation = job_generation;
+    }
+    // The thread calling parallel_for_tiles works on tiles too
+    for (int i = 1; i < thread_count; i++)
+    {
+        workers.emplace_back([this, generation]() { tile_worker(generation); });
+    }
+}
+
+// Closest and farthest depth written into the pixels of rect
+void rst::rasterizer::tile_depth_range(const screen_rect& rect, float& z_far, float& z_near) const
+{
+    const float empty = -std::numeric_limits<float>::infinity();
+    z_far = std::numeric_limits<float>::infinity();
+    z_near = empty;
+    for (int y = rect.y0; y < rect.y1; y++)
+    {
+        for (int x = rect.x0; x < rect.x1; x++)
+        {
+            float z = depth_buf[y * width + x];
+            if (z == empty)
+                continue;
+            z_far = std::min(z_far, z);
+            z_near = std::max(z_near, z);
+        }
+    }
+}
+
+// Deferred shading: runs the fragment shader once for every pixel that received a fragment
+void rst::rasterizer::shade_gbuffer()
+{
+    const float empty = -std::numeric_limits<float>::infinity();
+    parallel_for_tiles([&](int tile, const screen_rect& rect) {
+        // Nothing was rasterized into the tile since the last clear
+        if (depth_tiles[tile] != TileState::Written)
+            return;
+
+        light_list lights = all_lights();
+        if (light_culling)
+        {
+            // The depth range of the tile is known exactly here
+            float z_far, z_near;
+            tile_depth_range(rect, z_far, z_near);
+            cull_lights(rect, z_far, z_near, tile_lights[tile]);
+            lights = {tile_lights[tile].data(), tile_lights[tile].data() + tile_lights[tile].size()};
+        }
+
+        uint64_t covered = 0;
+        for (int y = rect.y0; y < rect.y1; y++)
+        {
+            for (int x = rect.x0; x < rect.x1; x++)
+            {
+                if (depth_buf[y * width + x] != empty)
+                {
+                    gbuffer[y * width + x].lights = lights;
+                    covered++;
+                }
+            }
+        }
+        light_count += covered * lights.size();
+
+        if (batch_shader)
+        {
+            fragment_queue queue;
+            queue.lights = lights;
+            for (int y = rect.y0; y < rect.y1; y++)
+            {
+                for (int x = rect.x0; x < rect.x1; x++)
+                {
+                    if (depth_buf[y * width + x] != -std::numeric_limits<float>::infinity())
+                        queue_fragment(queue, x, y, gbuffer[y * width + x]);
+                }
+            }
+            flush_fragments(queue);
+            return;
+        }
+
+        uint64_t shaded = 0;
+        Eigen::Vector3f colors[TILE_SIZE];
+        for (int y = rect.y0; y < rect.y1; y++)
+        {
+            // Shade each run of covered pixels straight out of the G-buffer
+            int x = rect.x0;
+            while (x < rect.x1)
+            {
+                if (depth_buf[y * width + x] == -std::numeric_limits<float>::infinity())
+                {
+                    x++;
+                    continue;
+                }
+
+                int run_end = x + 1;
+                while (run_end < rect.x1 && depth_buf[y * width + run_end] != -std::numeric_limits<float>::infinity())
+                    run_end++;
+
+                shade_fragments(&gbuffer[y * width + x], run_end - x, colors);
+                for (int k = x; k < run_end; k++)
+                {
+                    set_pixel(Eigen::Vector2i(k, y), colors[k - x]);
+                }
+                shaded += run_end - x;
+                x = run_end;
+            }
+        }
+        shaded_count += shaded;
+    });
+}
+
+// Visibility buffer shading: every covered pixel is shaded once, its attributes rebuilt from the
+// setup of the triangle it holds. Neighbouring pixels mostly hold the same few triangles, so the
+// setups are kept in a small direct mapped cache per tile.
+void rst::rasterizer::shade_visibility()
+{
+    constexpr int CACHE_SIZE = 64;
+    parallel_for_tiles([&](int tile, const screen_rect& rect) {
+        // No triangle of this draw reached the tile
+        if (vis_tiles[tile] != TileState::Written)
+            return;
+
+        light_list lights = all_lights();
+        if (light_culling)
+        {
+            float z_far, z_near;
+            tile_depth_range(rect, z_far, z_near);
+            cull_lights(rect, z_far, z_near, tile_lights[tile]);
+            lights = {tile_lights[tile].data(), tile_lights[tile].data() + tile_lights[tile].size()};
+        }
+
+        uint32_t cached_id[CACHE_SIZE];
+        std::fill(std::begin(cached_id), std::end(cached_id), INVALID_TRIANGLE);
+        varying_planes cached_planes[CACHE_SIZE];
+
+        fragment_queue queue;
+        queue.lights = lights;
+        uint64_t covered = 0;
+        uint64_t shaded = 0;
+        fragment_shader_payload payloads[TILE_SIZE];
+        int payload_x[TILE_SIZE];
+        Eigen::Vector3f colors[TILE_SIZE];
+        for (int y = rect.y0; y < rect.y1; y++)
+        {
+            unsigned count = 0;
+            for (int x = rect.x0; x < rect.x1; x++)
+            {
+                uint32_t id = vis_buf[y * width + x];
+                if (id == INVALID_TRIANGLE)
+                    continue;
+
+                varying_planes& planes = cached_planes[id % CACHE_SIZE];
+                if (cached_id[id % CACHE_SIZE] != id)
+                {
+                    // Same setup the triangle got when it was rasterized, so the attributes match
+                    // the forward path bit for bit
+                    triangle_setup s;
+                    setup_triangle(binned_tris[id].toVector4(), s);
+                    setup_varyings(binned_tris[id], binned_view_pos[id], s, used_varyings, planes);
+                    cached_id[id % CACHE_SIZE] = id;
+                }
+                covered++;
+
+                fragment_shader_payload payload;
+                payload.texture = texture ? &*texture : nullptr;
+                payload.uniforms = &uniforms;
+                payload.lights = lights;
+                interpolate_varyings(planes, x, y, payload);
+
+                if (batch_shader)
+                {
+                    queue_fragment(queue, x, y, payload);
+                    continue;
+                }
+                payloads[count] = payload;
+                payload_x[count] = x;
+                count++;
+            }
+
+            if (count)
+            {
+                shade_fragments(payloads, count, colors);
+                for (unsigned i = 0; i < count; i++)
+                {
+                    set_pixel(Eigen::Vector2i(payload_x[i], y), colors[i]);
+                }
+                shaded += count;
+            }
+        }
+        flush_fragments(queue);
+        shaded_count += shaded;
+        light_count += covered * lights.size();
+    });
+}
+
+void rst::rasterizer::queue_fragment(fragment_queue& queue, int x, int y, const fragment_shader_payload& payload)
+{
+    fragment_batch& b = queue.batch;
+    unsigned i = queue.count;
+    for (int c = 0; c < 3; c++)
+    {
+        b.view_pos[c][i] = payload.view_pos[c];
+        b.color[c][i] = payload.color[c];
+        b.normal[c][i] = payload.normal[c];
+    }
+    b.tex_coords[0][i] = payload.tex_coords.x();
+    b.tex_coords[1][i] = payload.tex_coords.y();
+    b.tex_coords_dx[0][i] = payload.tex_coords_dx.x();
+    b.tex_coords_dx[1][i] = payload.tex_coords_dx.y();
+    b.tex_coords_dy[0][i] = payload.tex_coords_dy.x();
+    b.tex_coords_dy[1][i] = payload.tex_coords_dy.y();
+    for (int c = 0; c < 4; c++)
+    {
+        b.tangent[c][i] = payload.tangent[c];
+    }
+    b.texture = payload.texture;
+    b.uniforms = payload.uniforms;
+    b.lights = payload.lights;
+    queue.x[i] = x;
+    queue.y[i] = y;
+
+    if (++queue.count == FRAGMENT_BATCH_SIZE)
+    {
+        flush_fragments(queue);
+    }
+}
+
+// Zeroes the lanes from first on in every attribute of batch. The batch shaders compute all lanes
+// and only the active ones are kept, but the others must not hold uninitialized or stale values.
+static void clear_inactive_lanes(fragment_batch& batch, unsigned first)
+{
+    auto clear = [first](auto& attribute) {
+        for (auto& lanes : attribute)
+        {
+            std::fill(lanes + first, lanes + FRAGMENT_BATCH_SIZE, 0.0f);
+        }
+    };
+    clear(batch.view_pos);
+    clear(batch.color);
+    clear(batch.normal);
+    clear(batch.tex_coords);
+    clear(batch.tex_coords_dx);
+    clear(batch.tex_coords_dy);
+    clear(batch.tangent);
+}
+
+void rst::rasterizer::flush_fragments(fragment_queue& queue)
+{
+    if (!queue.count)
+        return;
+
+    float colors[3][FRAGMENT_BATCH_SIZE];
+    if (queue.count < FRAGMENT_BATCH_SIZE)
+    {
+        clear_inactive_lanes(queue.batch, queue.count);
+    }
+    queue.batch.active = (1u << queue.count) - 1;
+    batch_shader(queue.batch, colors);
+    for (unsigned i = 0; i < queue.count; i++)
+    {
+        set_pixel(Eigen::Vector2i(queue.x[i], queue.y[i]), Eigen::Vector3f(colors[0][i], colors[1][i], colors[2][i]));
+    }
+    shaded_count += queue.count;
+    queue.count = 0;
+}
+
+void rst::rasterizer::shade_fragments(const fragment_shader_payload* payloads, unsigned count, Eigen::Vector3f* colors)
+{
+    if (span_shader)
+    {
+        span_shader(payloads, count, colors);
+        return;
+    }
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        colors[i] = fragment_shader(payloads[i]);
+    }
+}
+
+static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
+{
+    return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
+}
+
+static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
+{
+    auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
+    auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
+
+    u /= weight;
+    v /= weight;
+
+    return Eigen::Vector2f(u, v);
+}
+
+void rst::rasterizer::rasterize_wireframe(const Triangle& t)
+{
+    draw_line(t.c(), t.a());
+    draw_line(t.c(), t.b());
+    draw_line(t.b(), t.a());
+}
+
+//Screen space rasterization, limited to the pixels inside rect
+void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos, const screen_rect& rect, fragment_queue& queue, RasterPass pass, uint32_t id)
+{
+        auto v = t.toVector4();
+    
+    float l = 99999999;
+    float r = -9999999;
+    float top = 99999999;
+    float d = -9999999;
+    for (size_t i = 0; i < v.size(); i++)
+    {
+        l = v[i].x() < l ? v[i].x() : l;
+        r = v[i].x() > r ? v[i].x() : r;
+        top = v[i].y() < top ? v[i].y() : top;
+        d = v[i].y() > d ? v[i].y() : d;  
+    }
+    
+    int x0 = (int)std::floor(std::clamp(l, (float)rect.x0, (float)rect.x1));
+    int x1 = (int)std::floor(std::clamp(r, (float)rect.x0 - 1, (float)rect.x1 - 1));
+    int y0 = (int)std::floor(std::clamp(top, (float)rect.y0, (float)rect.y1));
+    int y1 = (int)std::floor(std::clamp(d, (float)rect.y0 - 1, (float)rect.y1 - 1));
+    if (x0 > x1 || y0 > y1)
+        return;
+
+    // Interpolated depth is a convex combination of the vertex depths, so no pixel of the triangle
+    // gets closer than z_max (plus a margin for the rounding of the interpolation). The margin has an
+    // absolute part: at depth 0 a purely relative one vanishes, and the DepthEqual pass would cull
+    // fragments that match the prepass depth exactly.
+    float z_max = std::max({v[0].z(), v[1].z(), v[2].z()});
+    z_max += 1e-5f * (1 + std::max({std::fabs(v[0].z()), std::fabs(v[1].z()), std::fabs(v[2].z())}));
+    if (hiz_occluded(x0, y0, x1, y1, z_max))
+    {
+        hiz_culled_triangle_count++;
+        return;
+    }
+
+    triangle_setup s;
+    if (!setup_triangle(v, s))
+        return;
+    write_depth_tiles(x0, y0, x1, y1, pass == RasterPass::Visibility);
+
+    // Attribute setup, only for what the fragment shader reads
+    const bool shading = pass == RasterPass::Shade || pass == RasterPass::DepthEqual;
+    varying_planes planes;
+    if (shading)
+    {
+        setup_varyings(t, view_pos, s, used_varyings, planes);
+    }
+
+    span_kernel partial_kernel = select_span_kernel(simd, pass == RasterPass::DepthEqual, false);
+    span_kernel inside_kernel = select_span_kernel(simd, pass == RasterPass::DepthEqual, true);
+    uint64_t covered = 0;
+    uint64_t shaded = 0;
+    uint64_t culled_blocks = 0;
+    uint64_t rejected_blocks = 0;
+    uint64_t accepted_blocks = 0;
+    uint64_t lights_listed = 0;
+
+    // Walk the BLOCK_SIZE aligned blocks overlapping the bounding box
+    for (int by = y0 - y0 % BLOCK_SIZE; by <= y1; by += BLOCK_SIZE)
+    {
+        for (int bx = x0 - x0 % BLOCK_SIZE; bx <= x1; bx += BLOCK_SIZE)
+        {
+            if (z_max <= hiz_blocks[(by / BLOCK_SIZE) * blocks_x + bx / BLOCK_SIZE])
+            {
+                culled_blocks++;
+                continue;
+            }
+
+            float e_block[3];
+            for (int i = 0; i < 3; i++)
+            {
+                e_block[i] = s.A[i] * bx + s.B[i] * by + s.C[i];
+            }
+
+            int ys = std::max(by, y0), ye = std::min(by + BLOCK_SIZE - 1, y1);
+            int xs = std::max(bx, x0), xe = std::min(bx + BLOCK_SIZE - 1, x1);
+            unsigned lanes = ((1u << (xe - xs + 1)) - 1) << (xs - bx);
+
+            // Large triangles: most blocks are entirely outside (skipped) or inside (no coverage test)
+            span_kernel kernel = partial_kernel;
+            switch (classify_block(s, e_block, xs - bx, xe - bx, ys - by, ye - by))
+            {
+            case BlockCoverage::Outside:
+                rejected_blocks++;
+                continue;
+            case BlockCoverage::Inside:
+                accepted_blocks++;
+                kernel = inside_kernel;
+                break;
+            case BlockCoverage::Partial:
+                break;
+            }
+
+            bool depth_written = false;
+            for (int y = ys; y <= ye; y++)
+            {
+                float e_row[3];
+                for (int i = 0; i < 3; i++)
+                {
+                    e_row[i] = e_block[i] + s.b_step[i][y - by];
+                }
+
+                span_fragments frag;
+                unsigned passed = kernel(s, e_row, lanes, &depth_buf[y * width + bx], frag, covered);
+                if (pass == RasterPass::DepthOnly)
+                {
+                    depth_written |= passed != 0;
+                    continue;
+                }
+                if (pass == RasterPass::Visibility)
+                {
+                    depth_written |= passed != 0;
+                    for (int k = 0; passed; k++, passed >>= 1)
+                    {
+                        if (passed & 1)
+                            vis_buf[y * width + bx + k] = id;
+                    }
+                    continue;
+                }
+                depth_written |= pass == RasterPass::Shade && passed != 0;
+
+                // Payloads of the fragments that passed, shaded together once the span is done
+                fragment_shader_payload payloads[BLOCK_SIZE];
+                int payload_x[BLOCK_SIZE];
+                unsigned count = 0;
+                for (int k = 0; passed; k++, passed >>= 1)
+                {
+                    if (!(passed & 1))
+                        continue;
+
+                    int x = bx + k;
+                    lights_listed += queue.lights.size();
+                    fragment_shader_payload payload;
+                    payload.texture = texture ? &*texture : nullptr;
+                    payload.uniforms = &uniforms;
+                    payload.lights = queue.lights;
+                    interpolate_varyings(planes, x, y, payload);
+
+                    // Deferred mode keeps only the last fragment per pixel, shade_gbuffer shades it
+                    if (deferred)
+                    {
+                        gbuffer[y * width + x] = payload;
+                        continue;
+                    }
+
+                    if (batch_shader)
+                    {
+                        queue_fragment(queue, x, y, payload);
+                        continue;
+                    }
+
+                    payloads[count] = payload;
+                    payload_x[count] = x;
+                    count++;
+                }
+
+                if (count)
+                {
+                    Eigen::Vector3f colors[BLOCK_SIZE];
+                    shade_fragments(payloads, count, colors);
+                    for (unsigned i = 0; i < count; i++)
+                    {
+                        set_pixel(Eigen::Vector2i(payload_x[i], y), colors[i]);
+                    }
+                    shaded += count;
+                }
+            }
+
+            if (depth_written)
+            {
+                update_hiz(bx, by);
+            }
+        }
+    }
+
+    fragment_count += covered;
+    shaded_count += shaded;
+    hiz_culled_block_count += culled_blocks;
+    rejected_block_count += rejected_blocks;
+    accepted_block_count += accepted_blocks;
+    if (!deferred)
+    {
+        light_count += lights_listed;
+    }
+
+    // TODO: From your HW3, get the triangle rasterization code.
+    // TODO: Inside your rasterization loop:
+    //    * v[i].w() is the vertex view space depth value z.
+    //    * Z is interpolated view space depth for the current pixel
+    //    * zp is depth between zNear and zFar, used for z-buffer
+
+    // float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
+    // float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
+    // zp *= Z;
+
+    // TODO: Interpolate the attributes:
+    // auto interpolated_color
+    // auto interpolated_normal
+    // auto interpolated_texcoords
+    // auto interpolated_shadingcoords
+
+    // Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
+    // Use: payload.view_pos = interpolated_shadingcoords;
+    // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
+    // Use: auto pixel_color = fragment_shader(payload);
+
+ 
+}
+
+// Hierarchical Z: hiz_blocks holds the farthest (smallest) depth of every BLOCK_SIZE block,
+// hiz_tiles the farthest depth of every TILE_SIZE tile. Geometry whose closest depth is not in
+// front of that value cannot pass the depth test anywhere in the block/tile.
+bool rst::rasterizer::hiz_occluded(int x0, int y0, int x1, int y1, float z) const
+{
+    for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++)
+    {
+        for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++)
+        {
+            if (!(z <= hiz_tiles[ty * tiles_x + tx]))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Called after depth writes into the block starting at (bx, by)
+void rst::rasterizer::update_hiz(int bx, int by)
+{
+    float farthest = std::numeric_limits<float>::infinity();
+    int xe = std::min(bx + BLOCK_SIZE, width);
+    int ye = std::min(by + BLOCK_SIZE, height);
+    for (int y = by; y < ye; y++)
+    {
+        for (int x = bx; x < xe; x++)
+        {
+            farthest = std::min(farthest, depth_buf[y * width + x]);
+        }
+    }
+
+    float& block = hiz_blocks[(by / BLOCK_SIZE) * blocks_x + bx / BLOCK_SIZE];
+    float previous = block;
+    block = farthest;
+
+    // Depth only moves closer, so the tile value can only change if this block was its farthest one
+    int tx = bx / TILE_SIZE, ty = by / TILE_SIZE;
+    float& tile = hiz_tiles[ty * tiles_x + tx];
+    if (previous != tile)
+        return;
+
+    const int blocks_per_tile = TILE_SIZE / BLOCK_SIZE;
+    int bx_end = std::min((tx + 1) * blocks_per_tile, blocks_x);
+    int by_end = std::min((ty + 1) * blocks_per_tile, blocks_y);
+    farthest = std::numeric_limits<float>::infinity();
+    for (int j = ty * blocks_per_tile; j < by_end; j++)
+    {
+        for (int i = tx * blocks_per_tile; i < bx_end; i++)
+        {
+            farthest = std::min(farthest, hiz_blocks[j * blocks_x + i]);
+        }
+    }
+    tile = farthest;
+}
+
+bool rst::rasterizer::using_simd() const
+{
+    return select_span_kernel(simd, false, false) != depth_test_span_scalar<false, false>;
+}
+
+rst::raster_stats rst::rasterizer::stats() const
+{
+    return {fragment_count.load(), shaded_count.load(), hiz_culled_triangle_count.load(), hiz_culled_block_count.load(),
+            clipped_triangle_count.load(), culled_triangle_count.load(), vertex_count.load(), light_count.load(),
+            rejected_block_count.load(), accepted_block_count.load()};
+}
+
+void rst::rasterizer::reset_stats()
+{
+    fragment_count = 0;
+    shaded_count = 0;
+    hiz_culled_triangle_count = 0;
+    hiz_culled_block_count = 0;
+    clipped_triangle_count = 0;
+    culled_triangle_count = 0;
+    vertex_count = 0;
+    light_count = 0;
+    rejected_block_count = 0;
+    accepted_block_count = 0;
+}
+
+void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
+{
+    model = m;
+}
+
+void rst::rasterizer::set_view(const Eigen::Matrix4f& v)
+{
+    view = v;
+}
+
+void rst::rasterizer::set_projection(const Eigen::Matrix4f& p)
+{
+    projection = p;
+}
+
+// Fast clear: only the tile states change here, the pixels are filled per tile when first touched
+void rst::rasterizer::clear(rst::Buffers buff)
+{
+    if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
+    {
+        for (auto& state : color_tiles)
+        {
+            if (state == TileState::Written)
+                state = TileState::Cleared;
+        }
+    }
+    if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
+    {
+        for (auto& state : depth_tiles)
+        {
+            if (state == TileState::Written)
+                state = TileState::Cleared;
+        }
+        // hiz_occluded only looks at the tile values; the blocks of a tile are reset with its depth
+        std::fill(hiz_tiles.begin(), hiz_tiles.end(), -std::numeric_limits<float>::infinity());
+    }
+}
+
+// [0, 255] to 8 bits, rounding half to even and saturating like cv::saturate_cast<uchar>
+static unsigned char to_unorm8(float v)
+{
+    if (!(v > 0))
+        return 0;
+    return (unsigned char)std::lrint(std::min(v, 255.0f));
+}
+
+// IEEE half float, rounded to nearest even
+static uint16_t to_half(float f)
+{
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000u;
+    int exponent = (int)((x >> 23) & 0xff);
+    uint32_t mantissa = x & 0x7fffffu;
+    if (exponent == 0xff)
+        return sign | 0x7c00u | (mantissa ? 0x200u : 0);
+    exponent += 15 - 127;
+    if (exponent >= 31)
+        return sign | 0x7c00u;
+
+    int shift = 13;
+    if (exponent <= 0)
+    {
+        // Subnormal half: the implicit one becomes explicit and the rest shifts out
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000u;
+        shift = 14 - exponent;
+        exponent = 0;
+    }
+    uint32_t half = ((uint32_t)exponent << 10) + (mantissa >> shift);
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t midpoint = 1u << (shift - 1);
+    if (rest > midpoint || (rest == midpoint && (half & 1)))
+        half++; // may carry into the exponent, which is still the right rounding
+    return (uint16_t)(sign | half);
+}
+
+static const uint16_t HALF_ONE = 0x3c00;
+
+// Fills a Cleared color tile with black. The buffers are stored bottom row first, see set_pixel.
+void rst::rasterizer::fill_color_tile(int tile)
+{
+    int tx = tile % tiles_x, ty = tile / tiles_x;
+    int x0 = tx * TILE_SIZE, x1 = std::min(x0 + TILE_SIZE, width);
+    int y0 = ty * TILE_SIZE, y1 = std::min(y0 + TILE_SIZE, height);
+    for (int y = y0; y < y1; y++)
+    {
+        int row = (height - 1 - y) * width;
+        switch (pixel_format)
+        {
+        case PixelFormat::RGB32F:
+            std::fill(frame_buf.begin() + row + x0, frame_buf.begin() + row + x1, Eigen::Vector3f{0, 0, 0});
+            break;
+        case PixelFormat::BGRA8:
+        {
+            const unsigned char black[4] = {0, 0, 0, 255};
+            for (int x = x0; x < x1; x++)
+                std::memcpy(&packed_buf[(row + x) * 4], black, 4);
+            break;
+        }
+        case PixelFormat::BGRA16F:
+        {
+            const uint16_t black[4] = {0, 0, 0, HALF_ONE};
+            for (int x = x0; x < x1; x++)
+                std::memcpy(&packed_buf[(row + x) * 8], black, 8);
+            break;
+        }
+        }
+    }
+}
+
+// Marks the depth tiles overlapping the pixels [x0, x1] x [y0, y1] Written, filling the Cleared
+// ones and their hi-z blocks first. Larger z is closer; -inf marks an empty pixel that any
+// fragment passes. With visibility the visibility buffer tiles get the same treatment.
+void rst::rasterizer::write_depth_tiles(int x0, int y0, int x1, int y1, bool visibility)
+{
+    for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++)
+    {
+        for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++)
+        {
+            int tile = ty * tiles_x + tx;
+            int xe = std::min((tx + 1) * TILE_SIZE, width);
+            int ye = std::min((ty + 1) * TILE_SIZE, height);
+            if (depth_tiles[tile] == TileState::Cleared)
+            {
+                for (int y = ty * TILE_SIZE; y < ye; y++)
+                {
+                    std::fill(&depth_buf[y * width + tx * TILE_SIZE], &depth_buf[y * width + xe], -std::numeric_limits<float>::infinity());
+                }
+                for (int by = ty * TILE_SIZE; by < ye; by += BLOCK_SIZE)
+                {
+                    float* row = &hiz_blocks[(by / BLOCK_SIZE) * blocks_x];
+                    std::fill(row + tx * TILE_SIZE / BLOCK_SIZE, row + (xe + BLOCK_SIZE - 1) / BLOCK_SIZE, -std::numeric_limits<float>::infinity());
+                }
+            }
+            depth_tiles[tile] = TileState::Written;
+
+            if (visibility && vis_tiles[tile] != TileState::Written)
+            {
+                for (int y = ty * TILE_SIZE; y < ye; y++)
+                {
+                    std::fill(&vis_buf[y * width + tx * TILE_SIZE], &vis_buf[y * width + xe], INVALID_TRIANGLE);
+                }
+                vis_tiles[tile] = TileState::Written;
+            }
+        }
+    }
+}
+
+void rst::rasterizer::resolve_color_tiles()
+{
+    for (int tile = 0; tile < (int)color_tiles.size(); tile++)
+    {
+        if (color_tiles[tile] == TileState::Cleared)
+        {
+            fill_color_tile(tile);
+            color_tiles[tile] = TileState::Clean;
+        }
+    }
+}
+
+std::vector<Eigen::Vector3f>& rst::rasterizer::frame_buffer()
+{
+    resolve_color_tiles();
+    return frame_buf;
+}
+
+cv::Mat rst::rasterizer::frame_view()
+{
+    resolve_color_tiles();
+    switch (pixel_format)
+    {
+    case PixelFormat::BGRA8:
+        return cv::Mat(height, width, CV_8UC4, packed_buf.data());
+    case PixelFormat::BGRA16F:
+#ifdef CV_16FC4
+        return cv::Mat(height, width, CV_16FC4, packed_buf.data());
+#else
+        // OpenCV 3 has no half float Mat type, hand out the bits as 16 bit integers
+        return cv::Mat(height, width, CV_16UC4, packed_buf.data());
+#endif
+    default:
+        return cv::Mat(height, width, CV_32FC3, frame_buf.data());
+    }
+}
+
+// Only the buffer of the current format is kept
+void rst::rasterizer::set_pixel_format(PixelFormat format)
+{
+    pixel_format = format;
+    if (format == PixelFormat::RGB32F)
+    {
+        frame_buf.resize(width * height);
+        std::vector<unsigned char>().swap(packed_buf);
+    }
+    else
+    {
+        packed_buf.resize((size_t)width * height * pixel_size());
+        std::vector<Eigen::Vector3f>().swap(frame_buf);
+    }
+    std::fill(color_tiles.begin(), color_tiles.end(), TileState::Cleared);
+}
+
+rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
+{
+    frame_buf.resize(w * h);
+    depth_buf.resize(w * h);
+
+    blocks_x = (w + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    blocks_y = (h + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+    hiz_blocks.resize(blocks_x * blocks_y);
+    hiz_tiles.resize(tiles_x * tiles_y);
+    // The buffers start out uninitialized, as if cleared and never resolved
+    color_tiles.assign(tiles_x * tiles_y, TileState::Cleared);
+    depth_tiles.assign(tiles_x * tiles_y, TileState::Cleared);
+    vis_tiles.assign(tiles_x * tiles_y, TileState::Cleared);
+
+    texture = std::nullopt;
+}
+
+rst::rasterizer::~rasterizer()
+{
+    stop_workers();
+}
+
+int rst::rasterizer::get_index(int x, int y)
+{
+    return (height-1-y)*width + x;
+}
+
+void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
+{
+    //old index: auto ind = point.y() + point.x() * width;
+    int ind = (height-1-point.y())*width + point.x();
+    TileState& state = color_tiles[(point.y() / TILE_SIZE) * tiles_x + point.x() / TILE_SIZE];
+    if (state != TileState::Written)
+    {
+        if (state == TileState::Cleared)
+            fill_color_tile((point.y() / TILE_SIZE) * tiles_x + point.x() / TILE_SIZE);
+        state = TileState::Written;
+    }
+
+    switch (pixel_format)
+    {
+    case PixelFormat::RGB32F:
+        frame_buf[ind] = color;
+        break;
+    case PixelFormat::BGRA8:
+    {
+        const unsigned char bgra[4] = {to_unorm8(color.z()), to_unorm8(color.y()), to_unorm8(color.x()), 255};
+        std::memcpy(&packed_buf[ind * 4], bgra, 4);
+        break;
+    }
+    case PixelFormat::BGRA16F:
+    {
+        const uint16_t bgra[4] = {to_half(color.z()), to_half(color.y()), to_half(color.x()), HALF_ONE};
+        std::memcpy(&packed_buf[ind * 8], bgra, 8);
+        break;
+    }
+    }
 }
 
 void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader)
@@ -387,8 +1989,11 @@ void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_sha
     vertex_shader = vert_shader;
 }
 
-void rst::rasterizer::set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader)
+void rst::rasterizer::set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader, Varyings varyings)
 {
     fragment_shader = frag_shader;
+    span_shader = nullptr;
+    batch_shader = nullptr;
+    used_varyings = varyings;
 }
 
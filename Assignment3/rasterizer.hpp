@@ -7,9 +7,15 @@
 #include <Eigen/Eigen>
 #include <optional>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include "global.hpp"
 #include "Shader.hpp"
 #include "Triangle.hpp"
+#include "Mesh.hpp"
 
 using namespace Eigen;
 
@@ -37,6 +43,16 @@ namespace rst
         Triangle
     };
 
+    // Storage of the color buffer. Shaded colors are in [0, 255]; set_pixel converts them to the
+    // format as it writes. BGRA8 rounds and clamps like cv::Mat::convertTo to CV_8U, alpha is 255.
+    // BGRA16F keeps the [0, 255] range in half floats, alpha is 1.
+    enum class PixelFormat
+    {
+        RGB32F,  // Eigen::Vector3f per pixel, frame_buffer()
+        BGRA8,   // CV_8UC4
+        BGRA16F  // CV_16FC4, CV_16UC4 holding the raw half bits before OpenCV 4
+    };
+
     /*
      * For the curious : The draw function takes two buffer id's as its arguments. These two structs
      * make sure that if you mix up with their orders, the compiler won't compile it.
@@ -57,14 +73,110 @@ namespace rst
         int col_id = 0;
     };
 
+    struct tex_buf_id
+    {
+        int tex_id = 0;
+    };
+
+    struct tan_buf_id
+    {
+        int tan_id = 0;
+    };
+
+    // Contents of one screen tile of the color, depth or visibility buffer. clear() (begin_draw for
+    // the visibility buffer) only marks tiles Cleared; a Cleared tile is filled with the clear value
+    // when it is first written (Written) or read out (Clean, holding the clear value, so the next
+    // clear costs nothing for it). The hi-z blocks of a depth tile are reset along with it.
+    enum class TileState : uint8_t
+    {
+        Clean,
+        Cleared,
+        Written
+    };
+
+    // Pixel rectangle [x0, x1) x [y0, y1) in screen space
+    struct screen_rect
+    {
+        int x0, y0, x1, y1;
+    };
+
+    // What rasterize_triangle does with a triangle: shade the fragments that pass the depth test and
+    // write their depth, only write depth (prepass), shade the fragments whose depth equals the
+    // depth buffer without writing it (the shading pass after a prepass), or write depth and the
+    // triangle's id into the visibility buffer
+    enum class RasterPass
+    {
+        Shade,
+        DepthOnly,
+        DepthEqual,
+        Visibility
+    };
+
+    // Visibility buffer value of a pixel no triangle of the current draw covers
+    constexpr uint32_t INVALID_TRIANGLE = 0xffffffffu;
+
+    // Side length in pixels of the screen tiles used by the binned draw path
+    constexpr int TILE_SIZE = 64;
+    // Side length of the blocks rasterize_triangle walks; edge functions are anchored at block corners
+    constexpr int BLOCK_SIZE = 8;
+    static_assert(TILE_SIZE % BLOCK_SIZE == 0, "tiles must be made of whole blocks");
+    // Half extent of the guard band in NDC; triangles are only clipped against its sides, anything
+    // between the screen and the guard band is left to the bounding box clamp in rasterize_triangle
+    constexpr float GUARD_BAND = 4.0f;
+
+    struct raster_stats
+    {
+        uint64_t fragments = 0; // pixels covered by a triangle
+        uint64_t shaded = 0;    // fragments that passed the depth test and were shaded
+        uint64_t hiz_culled_triangles = 0; // triangle/tile pairs rejected by the hierarchical Z test
+        uint64_t hiz_culled_blocks = 0;    // blocks skipped by the hierarchical Z test
+        uint64_t clipped_triangles = 0;    // triangles crossing the near plane or the guard band
+        uint64_t culled_triangles = 0;     // triangles rejected behind the near plane or off screen
+        uint64_t vertices = 0;             // vertex shader invocations
+        uint64_t lights = 0;               // sum of the light list sizes of the shaded fragments
+        uint64_t rejected_blocks = 0;      // blocks found entirely outside their triangle
+        uint64_t accepted_blocks = 0;      // blocks found entirely inside, rasterized without coverage test
+    };
+
+    // Fragments waiting for the batch shader, with the pixel each one goes to
+    struct fragment_queue
+    {
+        fragment_batch batch;
+        int x[FRAGMENT_BATCH_SIZE];
+        int y[FRAGMENT_BATCH_SIZE];
+        unsigned count = 0;
+        // Lights of the fragments queued from here on
+        light_list lights;
+    };
+
+    // Screen space bounds of a light's bounding sphere
+    struct light_extent
+    {
+        float x0, y0, x1, y1; // pixels
+        float z_far, z_near;  // depth_buf values, larger is closer
+    };
+
+    // Vertex between the vertex stage and the perspective divide, everything the clipper has to carry
+    struct clip_vertex
+    {
+        Eigen::Vector4f pos;      // clip space
+        Eigen::Vector3f view_pos;
+        Eigen::Vector3f normal;   // view space
+        Eigen::Vector2f tex_coords;
+        Eigen::Vector4f tangent;  // view space, w is the bitangent sign
+    };
+
     class rasterizer
     {
     public:
         rasterizer(int w, int h);
+        ~rasterizer();
         pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
         ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
         col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
         col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+        tex_buf_id load_tex_coords(const std::vector<Eigen::Vector2f>& tex_coords);
+        tan_buf_id load_tangents(const std::vector<Eigen::Vector4f>& tangents);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
@@ -72,8 +184,55 @@ namespace rst
 
         void set_texture(Texture tex) { texture = tex; }
 
+        // Uniform blocks seen by every fragment of the following draws
+        void set_lights(const light_block& block);
+        void set_camera(const camera_block& block) { uniforms.camera = block; }
+        void set_material(const material_block& block) { uniforms.material = block; }
+
         void set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader);
-        void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader);
+        // varyings declares the payload fields the shader reads, only those are interpolated
+        void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader, Varyings varyings = Varyings::All);
+        // Shade through a compile-time specialized span shader (see shade_span) instead of the
+        // std::function; set_fragment_shader switches back
+        void set_fragment_shader(fragment_span_shader frag_shader, Varyings varyings = Varyings::All)
+        {
+            span_shader = frag_shader;
+            batch_shader = nullptr;
+            used_varyings = varyings;
+        }
+        // Shade FRAGMENT_BATCH_SIZE fragments at a time in SoA form; fragments are queued per tile and
+        // written in the order they were rasterized, so the image matches the per fragment shaders
+        void set_fragment_shader(fragment_batch_shader frag_shader, Varyings varyings = Varyings::All)
+        {
+            batch_shader = frag_shader;
+            span_shader = nullptr;
+            used_varyings = varyings;
+        }
+
+        // 1 keeps the serial path, >1 bins triangles into tiles rasterized on that many threads
+        // The worker threads are started here and kept for every later draw
+        void set_thread_count(int n);
+        // Tiled light culling: triangles are binned (also with one thread) and every tile gets the
+        // lights whose bounding sphere overlaps it on screen and in the tile's depth range; fragments
+        // only evaluate those. Lights are culled where the fragment's view_pos is, so shaders that
+        // move the shaded point (displacement) may miss a little light at the edge of a radius.
+        void set_light_culling(bool on) { light_culling = on; }
+        // Use the 8-wide coverage/depth kernel when the CPU supports it (AVX2), the scalar one otherwise
+        void set_simd(bool enable) { simd = enable; }
+        bool using_simd() const;
+        // Rasterize into a G-buffer and run the fragment shader once per covered pixel afterwards
+        void set_deferred(bool enable) { deferred = enable; }
+        // Draw in two passes over the same transformed and binned triangles: depth only first, then
+        // shade only the fragments whose depth equals the final depth buffer. Coplanar triangles
+        // drawn twice shade the same pixel twice.
+        void set_depth_prepass(bool enable) { depth_prepass = enable; }
+        // Rasterize the triangles of a draw roughly front to back (radix sort on their depth) instead
+        // of in submission order, so the depth test rejects more fragments before they are shaded.
+        // Triangles at the same coarse depth keep their order.
+        void set_front_to_back(bool enable) { front_to_back = enable; }
+        // Rasterize only depth and a 32 bit triangle id per pixel, then shade every covered pixel once,
+        // rebuilding its attributes from the triangle. Takes precedence over set_deferred.
+        void set_visibility_buffer(bool enable) { visibility_buffer = enable; }
 
         void set_pixel(const Vector2i &point, const Eigen::Vector3f &color);
 
@@ -81,13 +240,75 @@ namespace rst
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
         void draw(std::vector<Triangle *> &TriangleList);
+        // Indexed triangles, every vertex referenced by ind_buffer runs through the vertex shader once
+        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id normal_buffer, tex_buf_id tex_buffer);
+        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id normal_buffer, tex_buf_id tex_buffer, tan_buf_id tangent_buffer);
+        // Same, reading the attribute arrays of the mesh in place
+        void draw(const Mesh& mesh);
+
+        // Drops the contents of the color buffer
+        void set_pixel_format(PixelFormat format);
+        PixelFormat get_pixel_format() const { return pixel_format; }
+
+        // Resolve the tiles still pending a clear, so every pixel is valid. frame_buffer() is only
+        // filled in RGB32F; frame_view() wraps the buffer of any format without copying, bottom row
+        // first like an image (valid until the next set_pixel_format). Only the BGRA8 view can go to
+        // imshow as is, and imwrite needs the alpha dropped (COLOR_BGRA2BGR) for formats without
+        // it. The RGB32F view is RGB ordered floats in [0, 255] and the BGRA16F one half floats in
+        // the same range, neither is directly encodable: convertTo CV_8U (and RGB2BGR) first.
+        std::vector<Eigen::Vector3f>& frame_buffer();
+        cv::Mat frame_view();
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        raster_stats stats() const;
+        void reset_stats();
 
     private:
         void draw_line(Eigen::Vector4f begin, Eigen::Vector4f end);
 
-        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        void draw_indexed(const Eigen::Vector3f* positions, int vertex_count, const Eigen::Vector3i* indices, int triangle_count,
+                          const Eigen::Vector3f* normals, const Eigen::Vector2f* tex_coords, const Eigen::Vector4f* tangents);
+        clip_vertex process_vertex(const Eigen::Vector4f& pos, const Eigen::Vector3f& normal, const Eigen::Vector2f& tex_coords, const Eigen::Vector4f& tangent,
+                                   const Eigen::Matrix4f& mvp, const Eigen::Matrix4f& model_view, const Eigen::Matrix4f& inv_trans);
+        void begin_draw();
+        void assemble_triangle(const clip_vertex (&cv)[3]);
+        void end_draw();
+
+        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos, const screen_rect& rect, fragment_queue& queue, RasterPass pass, uint32_t id = INVALID_TRIANGLE);
+        bool binning() const { return thread_count > 1 || light_culling || depth_prepass || front_to_back || visibility_buffer; }
+        void sort_front_to_back();
+        void compute_light_extents();
+        void cull_lights(const screen_rect& rect, float z_far, float z_near, std::vector<int>& out) const;
+        light_list all_lights() const { return {light_indices.data(), light_indices.data() + light_indices.size()}; }
+        // Triangles are drawn in the order given by the indices in order, in submission order when null
+        void rasterize_tiles(const std::vector<Triangle>& tris, const std::vector<std::array<Eigen::Vector3f, 3>>& view_pos,
+                             const uint32_t* order, RasterPass pass);
+        // Runs job(tile, rect) once for every screen tile on the worker pool and the calling thread.
+        // The job is passed as a function pointer and a context, nothing is allocated per call
+        template <typename Job>
+        void parallel_for_tiles(const Job& job)
+        {
+            run_tiles([](const void* context, int tile, const screen_rect& rect) {
+                (*static_cast<const Job*>(context))(tile, rect);
+            }, &job);
+        }
+        using tile_job = void (*)(const void* context, int tile, const screen_rect& rect);
+        void run_tiles(tile_job job, const void* context);
+        void run_tile_job();
+        void tile_worker(uint64_t seen);
+        void stop_workers();
+        void tile_depth_range(const screen_rect& rect, float& z_far, float& z_near) const;
+        void shade_gbuffer();
+        void shade_visibility();
+        void shade_fragments(const fragment_shader_payload* payloads, unsigned count, Eigen::Vector3f* colors);
+        void queue_fragment(fragment_queue& queue, int x, int y, const fragment_shader_payload& payload);
+        void flush_fragments(fragment_queue& queue);
+
+        void fill_color_tile(int tile);
+        void resolve_color_tiles();
+        void write_depth_tiles(int x0, int y0, int x1, int y1, bool visibility);
+
+        bool hiz_occluded(int x0, int y0, int x1, int y1, float z) const;
+        void update_hiz(int bx, int by);
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
         void rasterize_wireframe(const Triangle& t);
 
@@ -102,17 +323,93 @@ namespace rst
         std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
         std::map<int, std::vector<Eigen::Vector3f>> col_buf;
         std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        std::map<int, std::vector<Eigen::Vector2f>> tex_buf;
+        std::map<int, std::vector<Eigen::Vector4f>> tan_buf;
 
         std::optional<Texture> texture;
 
         std::function<Eigen::Vector3f(fragment_shader_payload)> fragment_shader;
         std::function<Eigen::Vector3f(vertex_shader_payload)> vertex_shader;
+        fragment_span_shader span_shader = nullptr;
+        fragment_batch_shader batch_shader = nullptr;
+        Varyings used_varyings = Varyings::All;
+        shader_uniforms uniforms;
+        // 0 .. lights - 1, the light list without culling
+        std::vector<int> light_indices;
+        // Per light of the current draw and per tile, see set_light_culling
+        std::vector<light_extent> light_extents;
+        std::vector<std::vector<int>> tile_lights;
 
+        PixelFormat pixel_format = PixelFormat::RGB32F;
         std::vector<Eigen::Vector3f> frame_buf;
+        // Color buffer of the BGRA8 and BGRA16F formats, pixel_size() bytes per pixel
+        std::vector<unsigned char> packed_buf;
+        int pixel_size() const { return pixel_format == PixelFormat::BGRA8 ? 4 : 8; }
         std::vector<float> depth_buf;
+        // Per screen tile, see TileState
+        std::vector<TileState> color_tiles;
+        std::vector<TileState> depth_tiles;
+        std::vector<TileState> vis_tiles;
         int get_index(int x, int y);
 
+        // Interpolated attributes of the visible fragment of each pixel, indexed like depth_buf
+        std::vector<fragment_shader_payload> gbuffer;
+        // Index into binned_tris of the visible triangle of each pixel, see set_visibility_buffer
+        std::vector<uint32_t> vis_buf;
+
+        // Screen space triangles of the current draw waiting for rasterize_tiles
+        std::vector<Triangle> binned_tris;
+        std::vector<std::array<Eigen::Vector3f, 3>> binned_view_pos;
+        // Scratch of sort_front_to_back
+        std::vector<uint32_t> sort_keys;
+        std::vector<uint32_t> sort_order, sort_scratch;
+        // Triangle indices per tile of rasterize_tiles
+        std::vector<std::vector<int>> tile_bins;
+        // Post-transform cache of the indexed draw
+        std::vector<clip_vertex> vertex_cache;
+        std::vector<bool> vertex_cached;
+        // Batch of the serial path, flushed at the end of the draw
+        fragment_queue serial_queue;
+
+        // Farthest depth per block and per tile, see hiz_occluded
+        std::vector<float> hiz_blocks;
+        std::vector<float> hiz_tiles;
+
         int width, height;
+        int blocks_x, blocks_y;
+        int tiles_x, tiles_y;
+        int thread_count = 1;
+
+        // Persistent pool for parallel_for_tiles: run_tiles publishes a job by bumping job_generation,
+        // each worker takes tiles from next_tile until none are left, the last one to finish wakes
+        // the caller
+        std::vector<std::thread> workers;
+        std::mutex pool_mutex;
+        std::condition_variable pool_start; // a job was published or the pool stops
+        std::condition_variable pool_done;  // busy_workers dropped to 0
+        tile_job current_job = nullptr;
+        const void* current_context = nullptr;
+        std::atomic<int> next_tile{0};
+        uint64_t job_generation = 0;
+        int busy_workers = 0;
+        bool stopping = false;
+        bool simd = true;
+        bool deferred = false;
+        bool light_culling = false;
+        bool depth_prepass = false;
+        bool front_to_back = false;
+        bool visibility_buffer = false;
+
+        std::atomic<uint64_t> fragment_count{0};
+        std::atomic<uint64_t> shaded_count{0};
+        std::atomic<uint64_t> hiz_culled_triangle_count{0};
+        std::atomic<uint64_t> hiz_culled_block_count{0};
+        std::atomic<uint64_t> clipped_triangle_count{0};
+        std::atomic<uint64_t> culled_triangle_count{0};
+        std::atomic<uint64_t> vertex_count{0};
+        std::atomic<uint64_t> light_count{0};
+        std::atomic<uint64_t> rejected_block_count{0};
+        std::atomic<uint64_t> accepted_block_count{0};
 
         int next_id = 0;
         int get_next_id() { return next_id++; }
@@ -0,0 +1,167 @@
+//
+// Writes images on background threads so encoding overlaps rendering
+//
+
+#ifndef RASTERIZER_IMAGE_WRITER_H
+#define RASTERIZER_IMAGE_WRITER_H
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Frames rotate through a small pool of buffers: acquire() hands out a free one, the caller
+// converts its frame straight into it and submit() queues it, encoder threads run cv::imwrite on
+// the queued buffers and put them back in the pool. At most capacity buffers are acquired or
+// queued; acquire() blocks while they all are, so a renderer faster than the disk is held back
+// instead of piling up frames. With the defaults frame N + 1 renders while frame N is encoded and
+// at most capacity + threads buffers ever exist.
+class ImageWriter{
+public:
+    explicit ImageWriter(int threads = 1, int capacity = 2) : capacity(std::max(1, capacity))
+    {
+        for (int i = 0; i < std::max(1, threads); i++)
+        {
+            workers.emplace_back([this]() { encode(); });
+        }
+    }
+
+    ImageWriter(const ImageWriter&) = delete;
+    ImageWriter& operator=(const ImageWriter&) = delete;
+
+    // Writes whatever is still queued, then stops the threads
+    ~ImageWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_all();
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // A free rows x cols buffer of type, to be filled and passed to submit(). Reserves a queue
+    // slot, blocking while capacity buffers are already acquired or queued.
+    cv::Mat acquire(int rows, int cols, int type)
+    {
+        cv::Mat buffer;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            space.wait(lock, [this]() { return (int)jobs.size() + acquired < capacity; });
+            acquired++;
+            if (!pool.empty())
+            {
+                buffer = pool.back();
+                pool.pop_back();
+            }
+        }
+        // Reallocates only if the pooled buffer has another size or type
+        buffer.create(rows, cols, type);
+        return buffer;
+    }
+
+    // Queues a buffer from acquire() for filename without copying it; the caller must not touch
+    // the buffer afterwards
+    void submit(const std::string& filename, const cv::Mat& buffer)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back({filename, buffer});
+            acquired--;
+            pending++;
+        }
+        queued.notify_one();
+    }
+
+    // Queues a copy of image, for callers that already have the frame in an encodable Mat. The
+    // caller may overwrite image as soon as this returns.
+    void write(const std::string& filename, const cv::Mat& image)
+    {
+        cv::Mat buffer = acquire(image.rows, image.cols, image.type());
+        image.copyTo(buffer);
+        submit(filename, buffer);
+    }
+
+    // Blocks until every image queued so far is on disk
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]() { return pending == 0; });
+    }
+
+    int failures() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return failed;
+    }
+
+    // filename with the frame index before the extension: out.png, 7 -> out_0007.png
+    static std::string sequenceName(const std::string& filename, int index)
+    {
+        char suffix[16];
+        std::snprintf(suffix, sizeof(suffix), "_%04d", index);
+        size_t dot = filename.find_last_of('.');
+        size_t slash = filename.find_last_of("/\\");
+        if (dot == std::string::npos || (slash != std::string::npos && slash > dot))
+            return filename + suffix;
+        return filename.substr(0, dot) + suffix + filename.substr(dot);
+    }
+
+private:
+    struct Job
+    {
+        std::string filename;
+        cv::Mat image;
+    };
+
+    void encode()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            queued.wait(lock, [this]() { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            space.notify_one();
+
+            lock.unlock();
+            bool ok = cv::imwrite(job.filename, job.image);
+            lock.lock();
+
+            if (!ok)
+            {
+                std::fprintf(stderr, "could not write %s\n", job.filename.c_str());
+                failed++;
+            }
+            pool.push_back(job.image);
+            if (--pending == 0)
+                done.notify_all();
+        }
+    }
+
+    const int capacity;
+    mutable std::mutex mutex;
+    std::condition_variable queued; // a job was queued or the writer stops
+    std::condition_variable space;  // a job left the queue
+    std::condition_variable done;   // pending dropped to 0
+    std::deque<Job> jobs;
+    std::vector<cv::Mat> pool;
+    int acquired = 0; // buffers handed out by acquire() and not submitted yet
+    int pending = 0;  // queued or being encoded
+    int failed = 0;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+#endif //RASTERIZER_IMAGE_WRITER_H